@@ -0,0 +1,170 @@
+#ifndef BAUDRATE_H_
+#define BAUDRATE_H_
+
+#include <EEPROM.h>
+#include "Arduino.h"
+#include "serial.h"
+#include "serialpacket.h"
+#include "serialqueue.h"
+
+// Rate every connection starts with
+#ifndef BAUD_RATE_DEFAULT
+#define BAUD_RATE_DEFAULT 115200
+#endif
+
+// Time the host gets to echo the test pattern at a new rate (ms)
+#ifndef BAUD_RATE_PROBE_TIMEOUT
+#define BAUD_RATE_PROBE_TIMEOUT 500
+#endif
+
+#define BAUD_RATE_PATTERN_SIZE 16
+
+/*
+ * Alternating bits, long runs of zeros and ones and single bits at both
+ * ends of a byte, which get garbled first at a rate the link cannot take.
+ * Frame start, end and escape bytes are left out.
+ */
+static const uint8_t baudRatePattern[BAUD_RATE_PATTERN_SIZE] = { 0x55, 0xAA,
+        0x00, 0xFF, 0x0F, 0xF0, 0x33, 0xCC, 0x01, 0x80, 0x7E, 0x81, 0x5A, 0xA5,
+        0x96, 0x69 };
+
+static SerialPacket baudRateProbeError(0x65, 0x06);
+
+/************************************************************************
+ * Switches the serial to a new baud rate, and back if the new rate does
+ * not work in both directions.
+ *
+ * The new rate is acknowledged with a 0x61 0x02 frame at the current rate.
+ * At the new rate a 0x61 0x73 frame with the test pattern follows, which
+ * the host has to send back unchanged within BAUD_RATE_PROBE_TIMEOUT. The
+ * rate is then confirmed with a 0x61 0x74 frame and stored. Otherwise the
+ * previous rate is restored and reported with a 0x65 0x06 frame. Bulk
+ * CAN data is held back until either happened.
+ */
+class BaudRateNegotiation {
+private:
+    HardwareSerial * serial;
+    SerialQueue * queue;
+    Stream * output;
+    int storeAddress = -1;
+    uint32_t rate = BAUD_RATE_DEFAULT;
+    uint32_t previousRate = BAUD_RATE_DEFAULT;
+    uint32_t probeStart = 0;
+    bool isProbing = false;
+
+    void switchTo(uint32_t rate) {
+        this->queue->flush();
+        // Waits until the last byte is out
+        this->serial->end();
+        this->serial->begin(rate);
+        this->rate = rate;
+    }
+
+    void sendRate(uint8_t id, uint32_t rate) {
+        SerialFrame<9> frame(0x61, id);
+        frame.appendLong(rate);
+        frame.send(this->output);
+    }
+
+    void revert() {
+        this->isProbing = false;
+        this->queue->holdBulk(false);
+        this->switchTo(this->previousRate);
+        baudRateProbeError.serialize(this->output);
+    }
+
+    static bool isValid(uint32_t rate) {
+        return rate >= 1200 && rate <= 2000000;
+    }
+public:
+    BaudRateNegotiation(HardwareSerial * serial, SerialQueue * queue) {
+        this->serial = serial;
+        this->queue = queue;
+        this->output = queue->getStream(SerialQueue::CONTROL);
+    }
+
+    /* Keeps the last confirmed rate in 4 bytes of EEPROM from the address */
+    void setStore(int address) {
+        this->storeAddress = address;
+    }
+
+    /* Last confirmed rate, 0 if none was stored */
+    uint32_t getStoredRate() {
+        if (this->storeAddress < 0) {
+            return 0;
+        }
+        uint32_t rate = 0;
+        for (uint8_t i = 0; i < 4; i++) {
+            rate = rate << 8 | EEPROM.read(this->storeAddress + i);
+        }
+        return isValid(rate) ? rate : 0;
+    }
+
+    uint32_t getRate() {
+        return this->rate;
+    }
+
+    /* Opens the serial at the default rate */
+    void begin() {
+        this->isProbing = false;
+        this->queue->holdBulk(false);
+        this->rate = BAUD_RATE_DEFAULT;
+        this->serial->begin(this->rate);
+    }
+
+    /* Returns false if the rate is out of range */
+    bool start(uint32_t rate) {
+        if (!isValid(rate)) {
+            return false;
+        }
+        if (!this->isProbing) {
+            this->previousRate = this->rate;
+        }
+        this->sendRate(0x02, rate);
+        this->switchTo(rate);
+
+        SerialFrame<BAUD_RATE_PATTERN_SIZE + 5> probe(0x61, 0x73);
+        probe.append(baudRatePattern, BAUD_RATE_PATTERN_SIZE);
+        probe.send(this->output);
+        this->probeStart = millis();
+        this->isProbing = true;
+        // CAN data waits for the confirmed rate, so none is lost to a revert
+        this->queue->holdBulk(true);
+        return true;
+    }
+
+    /* Commits the new rate if the echo of the test pattern is intact */
+    void onEcho(SerialPayload * payload) {
+        if (!this->isProbing) {
+            return;
+        }
+        bool isIntact = payload->available() == BAUD_RATE_PATTERN_SIZE;
+        for (uint8_t i = 0; isIntact && i < BAUD_RATE_PATTERN_SIZE; i++) {
+            isIntact = payload->readByte() == baudRatePattern[i];
+        }
+        if (!isIntact) {
+            this->revert();
+            return;
+        }
+
+        this->isProbing = false;
+        this->queue->holdBulk(false);
+        this->sendRate(0x74, this->rate);
+        if (this->storeAddress >= 0) {
+            for (uint8_t i = 0; i < 4; i++) {
+                EEPROM.update(this->storeAddress + i,
+                        this->rate >> (8 * (3 - i)));
+            }
+        }
+    }
+
+    /* Reverts to the previous rate once the echo is overdue */
+    void update() {
+        if (this->isProbing && (uint32_t) (millis() - this->probeStart)
+                >= BAUD_RATE_PROBE_TIMEOUT) {
+            this->revert();
+        }
+    }
+};
+
+#endif /* BAUDRATE_H_ */
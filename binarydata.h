@@ -2,90 +2,50 @@
 #define BINARYDATA_H_
 
 #include <stdint.h>
-#include "network.h"
+#include <string.h>
+#include "Arduino.h"
 
-class BinaryData {
+/************************************************************************
+ * Binary buffer with inline storage of a fixed capacity, no heap involved.
+ *
+ * Writes append to the end, reads consume from the front. The typed
+ * readers and writers do not check bounds themselves: check once with
+ * canRead() or canWrite() for a whole sequence of fields, then read or
+ * write them without further checks. Only varints, which have no fixed
+ * length, are checked as they go.
+ */
+template<uint8_t CAPACITY>
+class FixedBinaryBuffer {
 public:
-    BinaryData(uint8_t len);
-    ~BinaryData();
-    typedef enum STATUS {
-        OK, INDEXOUTOFBOUNDS
-    } AccessStatus;
-    struct ByteResult {
-        AccessStatus state;
-        unsigned char data;
+    enum ByteOrder {
+        MSB_FIRST, LSB_FIRST
     };
-    struct BoolResult {
-        AccessStatus state;
-        bool data;
-    };
-    struct LongResult {
-        AccessStatus state;
-        unsigned long int data;
-    };
-    AccessStatus toggleFlag(uint8_t index, unsigned char mask);
-    AccessStatus writeFlag(uint8_t index, unsigned char mask, bool value);
-    AccessStatus writeByte(uint8_t index, unsigned char value);
-    AccessStatus writeData(uint8_t index, BinaryData* data, uint8_t from,
-            uint8_t to);
-    BoolResult readFlag(uint8_t index, unsigned char mask,
-            unsigned char comparator);
-    ByteResult readByte(uint8_t index);
-    LongResult readLong(uint8_t index);
-    char* getData();
-    uint8_t getSize();
-private:
-    uint8_t _len = 0;
-    char* _payload;
-    AccessStatus checkIndex(uint8_t index);
-};
 
-class BinaryBuffer {
-public:
-    BinaryBuffer(uint8_t len) {
-        _data = new BinaryData(len);
+    bool canRead(uint8_t length) {
+        return _size - _position >= length;
     }
-    ~BinaryBuffer() {
-        delete _data;
+    bool canWrite(uint8_t length) {
+        return CAPACITY - _size >= length;
     }
     int available() {
-        return _data->getSize() - _position;
+        return _size - _position;
     }
-    BinaryData::ByteResult peek() {
-        return _data->readByte(_position);
-    }
-    BinaryData::ByteResult readByte() {
-        BinaryData::ByteResult result = _data->readByte(_position);
-        if (result.state == BinaryData::OK) {
-            _position++;
-        }
-        return result;
-    }
-    BinaryData::LongResult readLong() {
-        BinaryData::LongResult result = _data->readLong(_position);
-        if (result.state == BinaryData::OK) {
-            _position += 4;
-        }
-        return result;
+    void clear() {
+        _size = 0;
+        _position = 0;
     }
-    BinaryData::AccessStatus write(unsigned char value) {
-        BinaryData::AccessStatus result = _data->writeByte(_position, value);
-        if (result == BinaryData::OK) {
-            _position++;
+    /* Replaces the content, returns false if it does not fit */
+    bool assign(const uint8_t * data, uint8_t length) {
+        if (length > CAPACITY) {
+            return false;
         }
-        return result;
-    }
-    BinaryData::AccessStatus write(BinaryBuffer *otherBuffer) {
-        BinaryData::AccessStatus result = _data->writeData(_position,
-                otherBuffer->_data, otherBuffer->_position,
-                otherBuffer->_position + _data->getSize());
-        if (result == BinaryData::OK) {
-            _position += _data->getSize() - 1;
-        }
-        return result;
+        memcpy(_data, data, length);
+        _size = length;
+        _position = 0;
+        return true;
     }
     boolean goTo(int index) {
-        if (index < _data->getSize() - 1) {
+        if (index >= 0 && index <= _size) {
             _position = index;
             return true;
         }
@@ -94,19 +54,110 @@ public:
     uint8_t getPosition() {
         return _position;
     }
-    boolean next() {
-        if (_position < _data->getSize() - 1) {
-            _position++;
-            return true;
+    uint8_t getSize() {
+        return _size;
+    }
+    const uint8_t * getData() {
+        return _data;
+    }
+
+    uint8_t readByte() {
+        return _data[_position++];
+    }
+    uint16_t readShort(ByteOrder order = MSB_FIRST) {
+        return (uint16_t) read(2, order);
+    }
+    int16_t readSignedShort(ByteOrder order = MSB_FIRST) {
+        return (int16_t) read(2, order);
+    }
+    uint32_t readLong(ByteOrder order = MSB_FIRST) {
+        return read(4, order);
+    }
+    float readFloat(ByteOrder order = MSB_FIRST) {
+        uint32_t bits = read(4, order);
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    /*
+     * Unsigned LEB128 of up to 32 bits. Returns false and leaves the
+     * position as it was if the varint is cut off, longer than 5 bytes or
+     * does not fit into 32 bits.
+     */
+    bool readVarint(uint32_t * value) {
+        uint32_t result = 0;
+        for (uint8_t i = 0; i < 5 && _position + i < _size; i++) {
+            uint8_t data = _data[_position + i];
+            // The 5th byte only has room for bits 28 to 31
+            if (i == 4 && data > 0x0F) {
+                return false;
+            }
+            result |= (uint32_t) (data & 0x7F) << (7 * i);
+            if (!(data & 0x80)) {
+                _position += i + 1;
+                *value = result;
+                return true;
+            }
         }
         return false;
     }
-    uint8_t getSize() {
-        return _data->getSize();
+
+    void writeByte(uint8_t value) {
+        _data[_size++] = value;
+    }
+    void writeShort(uint16_t value, ByteOrder order = MSB_FIRST) {
+        write(value, 2, order);
+    }
+    void writeSignedShort(int16_t value, ByteOrder order = MSB_FIRST) {
+        write((uint16_t) value, 2, order);
+    }
+    void writeLong(uint32_t value, ByteOrder order = MSB_FIRST) {
+        write(value, 4, order);
+    }
+    void writeFloat(float value, ByteOrder order = MSB_FIRST) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        write(bits, 4, order);
+    }
+    /* Returns false if the varint does not fit, nothing is written then */
+    bool writeVarint(uint32_t value) {
+        uint8_t length = 1;
+        for (uint32_t rest = value >> 7; rest; rest >>= 7) {
+            length++;
+        }
+        if (!canWrite(length)) {
+            return false;
+        }
+        for (; length > 1; length--) {
+            writeByte((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        writeByte(value);
+        return true;
     }
 private:
-    BinaryData* _data;
+    uint8_t _data[CAPACITY];
+    uint8_t _size = 0;
     uint8_t _position = 0;
+
+    uint32_t read(uint8_t length, ByteOrder order) {
+        const uint8_t * p = _data + _position;
+        _position += length;
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < length; i++) {
+            uint8_t shift = order == MSB_FIRST ? 8 * (length - 1 - i) : 8 * i;
+            value |= (uint32_t) p[i] << shift;
+        }
+        return value;
+    }
+    void write(uint32_t value, uint8_t length, ByteOrder order) {
+        uint8_t * p = _data + _size;
+        _size += length;
+        for (uint8_t i = 0; i < length; i++) {
+            uint8_t shift = order == MSB_FIRST ? 8 * (length - 1 - i) : 8 * i;
+            p[i] = value >> shift;
+        }
+    }
 };
 
 #endif /* BINARYDATA_H_ */
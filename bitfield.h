@@ -9,26 +9,27 @@
  * proper endianness for the current CPU mode.
  *
  * Note: The fields can overlap if you want
+ *
+ * The access code is picked at compile time: single bits are one mask
+ * operation, fields of whole bytes are plain byte loads and stores, only
+ * everything else runs the generic shifting code.
  */
 
-template<int firstBit, int bitSize>
-struct BitFieldMember {
-    typedef BitFieldMember<firstBit, bitSize> self_t;
+enum BitFieldLayout {
+    BITFIELD_GENERIC, BITFIELD_SINGLE_BIT, BITFIELD_BYTE_ALIGNED
+};
+
+template<int firstBit, int bitSize, BitFieldLayout layout =
+        bitSize == 1 ? BITFIELD_SINGLE_BIT :
+        firstBit % 8 == 0 && bitSize % 8 == 0 ?
+                BITFIELD_BYTE_ALIGNED : BITFIELD_GENERIC>
+struct BitFieldAccess {
     typedef unsigned char uchar;
     enum {
         lastBit = firstBit + bitSize - 1, mask = (1ULL << bitSize) - 1
     };
-    uchar *selfArray() {
-        return reinterpret_cast<uchar *>(this);
-    }
-    const uchar *selfArray() const {
-        return reinterpret_cast<const uchar *>(this);
-    }
 
-    /* used to read data from the field */
-    /* will also work with all the operators that work with integral types */
-    inline operator unsigned() const {
-        const uchar *arr = selfArray();
+    static inline unsigned read(const uchar *arr) {
         const uchar *p = arr + firstBit / 8;
         int i = 8 - (firstBit & 7);
         unsigned ret = 0;
@@ -41,9 +42,7 @@ struct BitFieldMember {
         return ((ret >> (7 - (lastBit & 7))) & mask);
     }
 
-    /* used to assign a value into the field */
-    inline self_t& operator=(unsigned m) {
-        uchar *arr = selfArray();
+    static inline void write(uchar *arr, unsigned m) {
         m &= mask;
         unsigned wmask = ~(mask << (7 - (lastBit & 7)));
         m <<= (7 - (lastBit & 7));
@@ -56,6 +55,102 @@ struct BitFieldMember {
             (*(--p) &= wmask) |= m;
             i += 8;
         }
+    }
+
+    static inline void toggle(uchar *arr, unsigned m) {
+        m &= mask;
+        m <<= (7 - (lastBit & 7));
+        uchar *p = arr + lastBit / 8;
+        int i = (lastBit & 7) + 1;
+        *p ^= m;
+        while (i < bitSize) {
+            m >>= 8;
+            *(--p) ^= m;
+            i += 8;
+        }
+    }
+};
+
+template<int firstBit, int bitSize>
+struct BitFieldAccess<firstBit, bitSize, BITFIELD_SINGLE_BIT> {
+    typedef unsigned char uchar;
+    enum {
+        byte = firstBit / 8, bit = 0x80 >> (firstBit & 7)
+    };
+
+    static inline unsigned read(const uchar *arr) {
+        return (arr[byte] & bit) != 0;
+    }
+
+    static inline void write(uchar *arr, unsigned m) {
+        if (m & 1) {
+            arr[byte] |= bit;
+        } else {
+            arr[byte] &= ~bit;
+        }
+    }
+
+    static inline void toggle(uchar *arr, unsigned m) {
+        if (m & 1) {
+            arr[byte] ^= bit;
+        }
+    }
+};
+
+template<int firstBit, int bitSize>
+struct BitFieldAccess<firstBit, bitSize, BITFIELD_BYTE_ALIGNED> {
+    typedef unsigned char uchar;
+
+    static inline unsigned read(const uchar *arr) {
+        const uchar *p = arr + firstBit / 8;
+        unsigned ret = p[0];
+        for (int i = 1; i < bitSize / 8; i++) {
+            ret = ret << 8 | p[i];
+        }
+        return ret;
+    }
+
+    static inline void write(uchar *arr, unsigned m) {
+        uchar *p = arr + firstBit / 8;
+        for (int i = bitSize / 8 - 1; i >= 0; i--) {
+            p[i] = m;
+            m >>= 8;
+        }
+    }
+
+    static inline void toggle(uchar *arr, unsigned m) {
+        uchar *p = arr + firstBit / 8;
+        for (int i = bitSize / 8 - 1; i >= 0; i--) {
+            p[i] ^= m;
+            m >>= 8;
+        }
+    }
+};
+
+template<int firstBit, int bitSize>
+struct BitFieldMember {
+    typedef BitFieldMember<firstBit, bitSize> self_t;
+    typedef BitFieldAccess<firstBit, bitSize> access_t;
+    typedef unsigned char uchar;
+    enum {
+        lastBit = firstBit + bitSize - 1, mask = (1ULL << bitSize) - 1
+    };
+    uchar *selfArray() {
+        return reinterpret_cast<uchar *>(this);
+    }
+    const uchar *selfArray() const {
+        return reinterpret_cast<const uchar *>(this);
+    }
+
+    /* used to read data from the field */
+    /* will also work with all the operators that work with integral types */
+    inline operator unsigned() const {
+        return access_t::read(selfArray());
+    }
+
+    /* used to assign a value into the field */
+    inline self_t& operator=(unsigned m) {
+        access_t::write(selfArray(), m);
         return *this;
     }
 
@@ -94,18 +189,32 @@ struct BitFieldMember {
         return *this;
     }
 
+    // Single bits only need to touch their bit for the bitwise operators
+
     inline self_t& operator|=(unsigned m) {
-        *this = *this | m;
+        if (bitSize == 1) {
+            if (m & 1) {
+                *this = 1;
+            }
+        } else {
+            *this = *this | m;
+        }
         return *this;
     }
 
     inline self_t& operator&=(unsigned m) {
-        *this = *this & m;
+        if (bitSize == 1) {
+            if (!(m & 1)) {
+                *this = 0;
+            }
+        } else {
+            *this = *this & m;
+        }
         return *this;
     }
 
     inline self_t& operator^=(unsigned m) {
-        *this = *this ^ m;
+        access_t::toggle(selfArray(), m);
         return *this;
     }
 
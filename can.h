@@ -1,10 +1,20 @@
 #ifndef CAN_H_
 #define CAN_H_
 
+#include <avr/interrupt.h>
 #include <mcp_can.h>
+#include <SPI.h>
 #include "bitfield.h"
+#include "canbuffer.h"
+#include "canfilter.h"
+#include "cansignal.h"
+#include "canstore.h"
+#include "cansniffer.h"
+#include "serial.h"
+#include "serialqueue.h"
 #include "serialpacket.h"
 #include "carsystems.h"
+#include "statistics.h"
 
 static SerialPacket canInitError(0x65, 0x30);
 
@@ -16,108 +26,468 @@ static SerialPacket canSendTimeout(0x65, 0x34);
 
 static SerialPacket canControlError(0x65, 0x35);
 
+#ifndef CAN_AGGREGATE_FRAME_SIZE
+#define CAN_AGGREGATE_FRAME_SIZE 48
+#endif
+
+// Flag of the last 0x62 0x05 frame of a snapshot
+#define CAN_SNAPSHOT_LAST 0x01
+
+// Subscriptions are stored once they did not change for this long (ms)
+#ifndef CAN_STORE_DELAY
+#define CAN_STORE_DELAY 2000
+#endif
+
+#ifndef CAN_RECEIVE_BUFFER_SIZE
+#define CAN_RECEIVE_BUFFER_SIZE 16
+#endif
+
+/*
+ * Port whose pin change interrupt serves an interrupt pin without an
+ * external interrupt: 0 for D8-D13, 1 for A0-A5, 2 for D0-D7. The vector
+ * of that port is taken by the Can, unless CAN_NO_PCINT_ISR is defined for
+ * sketches that need it elsewhere (e.g. SoftwareSerial). Such pins are
+ * then polled.
+ */
+#ifndef CAN_PCINT_PORT
+#define CAN_PCINT_PORT 2
+#endif
+#define CAN_PCINT_VECTOR_(port) PCINT ## port ## _vect
+#define CAN_PCINT_VECTOR(port) CAN_PCINT_VECTOR_(port)
+
+class Can;
+static Can * interruptCan = NULL;
+static void onCanInterrupt();
+
 class Can {
 public:
     Can(Stream * serial, uint8_t canInterruptPin, uint8_t canCsPin) {
         this->serial = serial;
+        this->bulk = serial;
+        this->control = serial;
         this->can = new MCP_CAN(canCsPin);
+        this->sniffer = new CanSniffer(serial);
+        this->decoder = new CanSignalDecoder(serial);
         this->canInterruptPin = canInterruptPin;
     }
     ~Can() {
+        this->end();
         delete this->can;
-        for (int i = 0; i < this->carDataCount; i++) {
-            delete this->carData[i];
-        }
+        delete this->sniffer;
+        delete this->decoder;
     }
     boolean setup(uint8_t mode, uint8_t speed, uint8_t clock) {
         uint8_t canStatus = this->can->begin(mode, speed, clock);
+        this->mode = mode;
+        this->isFilterOutdated = true;
         if (canStatus == CAN_OK) {
             this->can->setMode(MCP_NORMAL);
             pinMode(this->canInterruptPin, INPUT);
             this->isInitialized = true;
+            this->attachReceiveInterrupt();
+            startupTimes.mark(StartupTimes::CAN_STARTED);
         } else {
-            canInitError.serialize(&Serial);
+            canInitError.serialize(this->control);
         }
         return this->isInitialized;
     }
 
-    void startSniffer() {
+    void end() {
+        this->detachReceiveInterrupt();
+        this->isInitialized = false;
+    }
+
+    /*
+     * Stops like end() and puts the MCP2515 to sleep. Activity on the bus
+     * wakes it up again and pulls the interrupt pin low. The frame that
+     * woke it up is lost, call setup() again after waking up.
+     *
+     * Frames still in the controller are read out first, as their receive
+     * flags would keep the interrupt pin low and wake the Arduino right
+     * away. Buffered frames are dropped, they are stale after sleeping.
+     */
+    void sleep() {
+        this->end();
+        // A busy bus would wake the controller right away anyway
+        for (uint8_t i = 0; i < CAN_RECEIVE_BUFFER_SIZE
+                && !digitalRead(this->canInterruptPin); i++) {
+            CanFrame dropped;
+            unsigned long canId = 0;
+            if (this->can->readMsgBuf(&canId, &dropped.length, dropped.data)
+                    != CAN_OK) {
+                break;
+            }
+        }
+        this->receiveBuffer.clear();
+        this->can->setSleepWakeup(1);
+        this->can->setMode(MCP_SLEEP);
+    }
+
+    uint8_t getInterruptPin() {
+        return this->canInterruptPin;
+    }
+
+    /*
+     * True if no received frame is waiting. A polled controller is never
+     * idle, as it could not wake up the CPU for its next frame.
+     */
+    bool isIdle() {
+        return !this->isInitialized || (this->isInterruptAttached
+                && this->receiveBuffer.count() == 0);
+    }
+
+    /* Watches for a frame of the CAN ID, filters stay open meanwhile */
+    void expectWakeId(uint32_t canId) {
+        this->wakeId = canId;
+        this->isWakeIdExpected = true;
+        this->isWakeIdSeen = false;
+        this->isFilterOutdated = true;
+    }
+
+    /* True once a frame of the expected wake ID was processed */
+    bool hasSeenWakeId() {
+        return this->isWakeIdSeen;
+    }
+
+    void stopExpectingWakeId() {
+        if (this->isWakeIdExpected) {
+            this->isWakeIdExpected = false;
+            this->isFilterOutdated = true;
+        }
+    }
+
+    /* Mode is a combination of the CAN_SNIFF_* flags */
+    void startSniffer(uint8_t mode = 0) {
+        this->sniffer->setMode(mode);
         this->isSniffing = true;
+        this->isFilterOutdated = true;
     }
 
     void stopSniffer() {
+        this->sniffer->setMode(0);
         this->isSniffing = false;
+        this->isFilterOutdated = true;
     }
 
-    bool addCanPacket(uint32_t canId, uint8_t mask) {
-        if (this->carDataCount < 50) {
-            this->removeCanPacket(canId);
-            this->carData[this->carDataCount] = new CarData(canId, mask);
-            this->carDataCount++;
+    /*
+     * Subscribes to the masked bytes of a CAN ID. With an interval (ms)
+     * changes are sent at most that often, always with the latest value.
+     */
+    bool addCanPacket(uint32_t canId, uint8_t mask, uint16_t interval = 0) {
+        if (this->carData.add(canId, mask, interval)) {
+            this->onSubscriptionsChanged();
             return true;
         }
-
         return false;
     }
 
-    void removeCanPacket(uint32_t canId) {
-        for (int index = 0; index < this->carDataCount; index++) {
-            CarData * data = this->carData[index];
-            if (data->getCanId() == canId) {
-                for (int moveIndex = index; moveIndex < this->carDataCount - 1; moveIndex++) {
-                    this->carData[moveIndex] = this->carData[moveIndex + 1];
-                }
-                delete data;
-                this->carDataCount--;
+    /*
+     * Subscribes to a list of entries of CAN ID (4 bytes), mask (1 byte) and
+     * optionally an interval (2 bytes). Either all entries are added or, if
+     * they do not fit, none. Returns the number of entries added. A frame
+     * from the host holds up to 25 entries, or 17 with intervals.
+     */
+    uint8_t addCanPackets(SerialPayload * entries, uint8_t count,
+            bool hasIntervals) {
+        uint8_t start = entries->getPosition();
+        uint8_t entrySize = hasIntervals ? 7 : 5;
+        // One check for all entries, they are read without checks below
+        if (!entries->canRead(count * entrySize)) {
+            return 0;
+        }
+
+        // An ID listed twice takes one entry, the last one listed wins
+        uint8_t newCount = 0;
+        for (uint8_t i = 0; i < count; i++) {
+            entries->goTo(start + i * entrySize);
+            uint32_t canId = entries->readLong();
+            bool isNew = !this->carData.find(canId);
+            for (uint8_t j = 0; isNew && j < i; j++) {
+                entries->goTo(start + j * entrySize);
+                isNew = entries->readLong() != canId;
+            }
+            if (isNew) {
+                newCount++;
             }
         }
+        if (this->carData.size() + newCount > CAN_MAX_CAR_DATA) {
+            return 0;
+        }
+
+        entries->goTo(start);
+        for (uint8_t i = 0; i < count; i++) {
+            uint32_t canId = entries->readLong();
+            uint8_t mask = entries->readByte();
+            uint16_t interval = hasIntervals ? entries->readShort() : 0;
+            this->carData.add(canId, mask, interval);
+        }
+        if (count > 0) {
+            this->onSubscriptionsChanged();
+        }
+        return count;
     }
 
-    void forwardFromSerial(uint8_t type, BinaryBuffer *payloadBuffer) {
-        if (type != 0x62) {
-            return;
+    /* Removes a list of CAN IDs (4 bytes each), returns how many existed */
+    uint8_t removeCanPackets(SerialPayload * canIds) {
+        uint8_t removed = 0;
+        while (canIds->canRead(4)) {
+            if (this->carData.remove(canIds->readLong())) {
+                removed++;
+            }
         }
+        if (removed > 0) {
+            this->onSubscriptionsChanged();
+        }
+        return removed;
+    }
 
-        BinaryData::LongResult idResult = payloadBuffer->readLong();
+    void clearCanPackets() {
+        this->carData.clear();
+        this->onSubscriptionsChanged();
+    }
 
-        if (idResult.state == BinaryData::AccessStatus::OK) {
-            uint8_t data[8];
-            for (uint8_t i = 0; i < payloadBuffer->getSize() - 4 && i < 8; i++) {
-                BinaryData::ByteResult byteResult = payloadBuffer->readByte();
-                if (byteResult.state == BinaryData::AccessStatus::OK) {
-                    data[i] = byteResult.data;
-                }
-            }
+    /*
+     * Keeps the subscriptions in EEPROM from the given address on and
+     * restores the stored ones right away. Returns true if any were stored.
+     */
+    bool setStore(int address) {
+        this->storeAddress = address;
+        this->isStoreOutdated = false;
+        if (CanStore::load(&this->carData, address)) {
+            this->isFilterOutdated = true;
+            return true;
+        }
+        return false;
+    }
+
+    /*
+     * Decodes the given signals from received frames and sends their
+     * values when they change. The signals have to outlive the Can.
+     */
+    void setSignals(const CanSignal * signals, uint8_t count) {
+        this->decoder->setSignals(signals, count);
+        this->isFilterOutdated = true;
+    }
+
+    void removeCanPacket(uint32_t canId) {
+        if (this->carData.remove(canId)) {
+            this->onSubscriptionsChanged();
+        }
+    }
+
+    void forwardFromSerial(uint8_t type, SerialPayload *payloadBuffer) {
+        if (type != 0x62 || !payloadBuffer->canRead(4)) {
+            return;
+        }
 
-            this->write(idResult.data, 0, payloadBuffer->getSize() - 4,
-                (uint8_t*) data);
+        uint32_t canId = payloadBuffer->readLong();
+        uint8_t length = payloadBuffer->available();
+        uint8_t data[8];
+        for (uint8_t i = 0; i < length && i < 8; i++) {
+            data[i] = payloadBuffer->readByte();
         }
+        this->write(canId, 0, length, data);
     }
 
     void updateFromCan(void (*canCallback)(uint32_t canId, uint8_t data[], uint8_t length)) {
         if (!this->isInitialized) {
-            canNotInitializedError.serialize(this->serial, 1000);
+            canNotInitializedError.serialize(this->control, 1000);
             return;
         }
 
-        if (!digitalRead(canInterruptPin)) {
-            long unsigned int canId = 0;
-            uint8_t canLength = 0;
+        if (this->isFilterOutdated) {
+            this->updateFilter();
+        }
+
+        // One entry per pass, an EEPROM byte takes 3.3 ms to write
+        if (this->isStoreOutdated && (uint16_t) ((uint16_t) millis()
+                - this->subscriptionsChangedAt) >= CAN_STORE_DELAY
+                && CanStore::saveStep(&this->carData, this->storeAddress,
+                        this->storeStep++)) {
+            this->isStoreOutdated = false;
+        }
+
+        // Without a receive interrupt the controller is polled here instead
+        if (!this->isInterruptAttached) {
+            this->receive();
+        }
+
+        // Frames lost in the receive buffer are reported with the next batch
+        uint32_t droppedFrameCount = this->getDroppedFrameCount();
+        uint32_t newDrops = droppedFrameCount - this->reportedDropCount;
+        this->sniffer->addDropped(newDrops);
+        this->reportedDropCount = droppedFrameCount;
+        statistics.add(Statistics::FRAMES_RECEIVED, newDrops);
+        statistics.add(Statistics::FRAMES_DROPPED, newDrops);
+
+        const CanFrame * frame;
+        if (!startupTimes.isReached(StartupTimes::FIRST_FRAME)
+                && this->receiveBuffer.count() > 0) {
+            startupTimes.mark(StartupTimes::FIRST_FRAME);
+        }
+        while ((frame = this->receiveBuffer.peek()) != NULL) {
+            uint32_t canId = frame->id;
+            uint32_t timestamp = frame->timestamp;
+            uint8_t canLength = frame->length;
             uint8_t canData[8];
+            memcpy(canData, frame->data, sizeof(canData));
+            this->receiveBuffer.release();
+            statistics.add(Statistics::FRAMES_RECEIVED);
+
+            if (this->isWakeIdExpected && canId == this->wakeId) {
+                this->isWakeIdSeen = true;
+                this->stopExpectingWakeId();
+            }
+
+            if (this->isSniffing || (this->carData.size() < 1
+                    && this->decoder->size() < 1)) {
+                this->sniffer->sniff(canId, canData, canLength, timestamp);
+            } else {
+                this->decoder->decode(canId, canData, canLength);
+                CarData * data = this->carData.find(canId);
+                if (data) {
+                    statistics.add(Statistics::FRAMES_MATCHED);
+                }
+                if (data && this->carData.update(data, canData, timestamp)) {
+                    this->hasPendingData = true;
+                    canCallback(canId, canData, canLength);
+                }
+            }
+        }
+
+        this->sniffer->flush();
+        this->sendPendingData();
+        this->sendSnapshot();
+        this->decoder->flush();
+    }
+
+    /*
+     * Sends only the changed bytes of standard CAN IDs, as 0x62 0x03 frames
+     * or 0x62 0x04 aggregates. Each entry is the CAN ID (2 bytes), a bitmap
+     * of the changed bytes (bit 7 is byte 0) and the changed bytes.
+     */
+    void setDelta(bool isDelta) {
+        this->isDelta = isDelta;
+    }
+
+    /*
+     * Prefixes aggregates with the time they are sent (micros, 4 bytes) and
+     * every aggregated entry with the age of its value in 64 us ticks
+     * (2 bytes), so the host can work out when each change was captured.
+     */
+    void setTimestamps(bool isTimestamped) {
+        this->isTimestamped = isTimestamped;
+    }
+
+    /* Number of changes of a CAN ID replaced by a newer value before sending */
+    uint8_t getCoalescedCount(uint32_t canId) {
+        CarData * data = this->carData.find(canId);
+        return data ? this->carData.getTiming(data)->getCoalescedCount() : 0;
+    }
+
+    /*
+     * Sends the cached value of every subscription that received a frame,
+     * in 0x62 0x05 frames. Pending changes are left as they are and still
+     * sent as changes.
+     */
+    void requestSnapshot() {
+        this->snapshotCursor = 0;
+        this->isSnapshotPending = true;
+        this->decoder->requestRefresh();
+    }
+
+    /* Sends the full value of every subscription with the next update */
+    void refresh() {
+        this->carData.requestRefresh();
+        this->hasPendingData = this->carData.size() > 0;
+        this->decoder->requestRefresh();
+    }
+
+    /*
+     * Routes error packets through the control queue and only sends CAN
+     * data while the queue is idle and the serial has room for it.
+     */
+    void setSerialQueue(SerialQueue * queue) {
+        this->queue = queue;
+        this->sniffer->setSerialQueue(queue);
+        this->decoder->setSerialQueue(queue);
+        this->control = queue ?
+                queue->getStream(SerialQueue::CONTROL) : this->serial;
+        this->bulk = queue ?
+                queue->getStream(SerialQueue::BULK) : this->serial;
+    }
+
+    /* Number of sniffed frames dropped because the serial was busy */
+    uint32_t getSkippedSniffCount() {
+        return this->sniffer->getDroppedCount();
+    }
+
+    /*
+     * Sends all CarData changed in one update as a single 0x62 0x02 frame
+     * instead of one 0x62 0x01 frame each.
+     */
+    void setAggregating(bool isAggregating) {
+        this->isAggregating = isAggregating;
+    }
 
-            this->can->readMsgBuf(&canId, &canLength, canData);
-            if (this->isSniffing || this->carDataCount < 1) {
-                this->sniff(canId, canData, canLength);
+    /*
+     * Moves every frame pending in the MCP2515 into the receive buffer.
+     * Runs from the interrupt handler, or from updateFromCan when the
+     * interrupt pin has no interrupt at all. Frames are stamped with the
+     * time they were taken from the controller, so polled frames carry the
+     * time of the poll.
+     */
+    void receive() {
+        while (!digitalRead(this->canInterruptPin)) {
+            CanFrame * frame = this->receiveBuffer.reserve();
+            if (frame) {
+                frame->timestamp = micros();
+                unsigned long canId = 0;
+                if (this->can->readMsgBuf(&canId, &frame->length, frame->data) != CAN_OK) {
+                    return;
+                }
+                frame->id = canId;
+                this->receiveBuffer.commit();
             } else {
-                for (uint8_t i = 0; i < this->carDataCount; i++) {
-                    if (this->carData[i]->serialize(canId, canData, this->serial)) {
-                        canCallback(canId, canData, canLength);
-                    }
+                // Buffer full, read the frame anyway to release the controller
+                CanFrame dropped;
+                unsigned long canId = 0;
+                if (this->can->readMsgBuf(&canId, &dropped.length, dropped.data) != CAN_OK) {
+                    return;
                 }
+                this->droppedFrameCount++;
             }
         }
     }
 
+    /*
+     * Queues a frame as if it was received from the bus, e.g. from a
+     * recorded trace. The frame is stamped with the current time, unless
+     * it carries its own time stamp. Returns false if the receive buffer
+     * is full.
+     */
+    bool inject(const CanFrame * source, bool isTimestamped = false) {
+        // The receive interrupt is the only other producer
+        noInterrupts();
+        CanFrame * frame = this->receiveBuffer.reserve();
+        if (frame) {
+            *frame = *source;
+            if (!isTimestamped) {
+                frame->timestamp = micros();
+            }
+            this->receiveBuffer.commit();
+        }
+        interrupts();
+        return frame != NULL;
+    }
+
+    uint32_t getDroppedFrameCount() {
+        noInterrupts();
+        uint32_t count = this->droppedFrameCount;
+        interrupts();
+        return count;
+    }
+
     template<uint8_t BYTE_INDEX, uint8_t BIT_MASK, uint8_t COMPARE_VALUE>
     static bool readFlag(uint8_t * data) {
         return (data[BYTE_INDEX] & BIT_MASK) == COMPARE_VALUE;
@@ -129,13 +499,14 @@ public:
 
     void write(INT32U id, INT8U ext, INT8U len, INT8U *buf) {
         if (!this->isInitialized) {
-            canNotInitializedError.serialize(this->serial, 1000);
+            canNotInitializedError.serialize(this->control, 1000);
             return;
         }
 
         uint8_t result = this->can->sendMsgBuf(id, ext, len, buf);
         if (result == CAN_GETTXBFTIMEOUT) {
-            canSendBufferFull.serialize(serial, 1000);
+            statistics.add(Statistics::CAN_SEND_BUFFER_FULL);
+            canSendBufferFull.serialize(this->control, 1000);
         } else if (result == CAN_SENDMSGTIMEOUT) {
             /*
              * Happens almost every second, thus popping up errors constantly.
@@ -147,25 +518,302 @@ public:
 private:
     MCP_CAN * can;
     Stream * serial;
-    CarData * carData[50];
-    uint8_t carDataCount = 0;
+    Stream * bulk;
+    Stream * control;
+    SerialQueue * queue = NULL;
+    CarDataTable carData;
 
     uint8_t canInterruptPin = 2;
     boolean isInitialized = false;
     boolean isSniffing = false;
+    boolean isInterruptAttached = false;
+    boolean isAggregating = false;
+    boolean isDelta = false;
+    boolean isTimestamped = false;
+    boolean hasPendingData = false;
+    uint8_t pendingCursor = 0;
+    CanSniffer * sniffer;
+    CanSignalDecoder * decoder;
+    uint32_t reportedDropCount = 0;
+
+    uint8_t mode = MCP_ANY;
+    CanFilter filter;
+    boolean isFilterOutdated = false;
 
-    void sniff(uint32_t canId, uint8_t canData[], uint8_t length) {
-        uint32_t flippedCanId = htonl(canId);
-        this->serial->write("{");
-        this->serial->write(0x62);
-        this->serial->write(0x6d);
-        this->serial->write(length + 0x04);
-        this->serial->write((byte*)&flippedCanId, sizeof(canId));
-        for (uint8_t i = 0; i < length; i++) {
-            this->serial->write(canData[i]);
+    uint32_t wakeId = 0;
+    boolean isWakeIdExpected = false;
+    boolean isWakeIdSeen = false;
+
+    CanFrameBuffer<CAN_RECEIVE_BUFFER_SIZE> receiveBuffer;
+    volatile uint32_t droppedFrameCount = 0;
+
+    int storeAddress = -1;
+    boolean isStoreOutdated = false;
+    uint8_t storeStep = 0;
+    uint16_t subscriptionsChangedAt = 0;
+
+    boolean isSnapshotPending = false;
+    uint8_t snapshotCursor = 0;
+
+    /* Stored with a delay, so a burst of changes is written only once */
+    void onSubscriptionsChanged() {
+        this->isFilterOutdated = true;
+        // Entries moved, a snapshot in progress starts over
+        this->snapshotCursor = 0;
+        if (this->storeAddress >= 0) {
+            // A save in progress starts over as well
+            this->isStoreOutdated = true;
+            this->storeStep = 0;
+            this->subscriptionsChangedAt = millis();
         }
-        this->serial->write("}");
+    }
+
+    /*
+     * Uses the external interrupt of the pin, or else the pin change
+     * interrupt of its port, e.g. PCINT21 for D5. Only pins of
+     * CAN_PCINT_PORT have a pin change handler, others are polled, and so
+     * are all of them with CAN_NO_PCINT_ISR.
+     */
+    void attachReceiveInterrupt() {
+        if (this->isInterruptAttached) {
+            return;
+        }
+
+        uint8_t pin = this->canInterruptPin;
+        int interrupt = digitalPinToInterrupt(pin);
+        if (interrupt != NOT_AN_INTERRUPT) {
+            interruptCan = this;
+            // Keep the handler from talking to the controller during SPI transactions
+            SPI.usingInterrupt(interrupt);
+            attachInterrupt(interrupt, onCanInterrupt, FALLING);
+#ifndef CAN_NO_PCINT_ISR
+        } else if (digitalPinToPCICR(pin)
+                && digitalPinToPCICRbit(pin) == CAN_PCINT_PORT) {
+            interruptCan = this;
+            // Pin change interrupts can only be masked all together
+            SPI.usingInterrupt(255);
+            *digitalPinToPCMSK(pin) |= bit(digitalPinToPCMSKbit(pin));
+            PCIFR = bit(digitalPinToPCICRbit(pin));
+            *digitalPinToPCICR(pin) |= bit(digitalPinToPCICRbit(pin));
+#endif
+        } else {
+            return;
+        }
+        this->isInterruptAttached = true;
+
+        // Frames received before attaching will not raise another edge
+        noInterrupts();
+        this->receive();
+        interrupts();
+    }
+
+    /*
+     * Reprograms the acceptance filters once per update, so a burst of
+     * subscription changes only costs one reconfiguration.
+     * Filters are ignored by the controller when started with MCP_ANY.
+     */
+    void updateFilter() {
+        this->isFilterOutdated = false;
+        if (this->mode == MCP_ANY) {
+            return;
+        }
+
+        if (this->isSniffing || this->isWakeIdExpected) {
+            CanFilter::open(this->can);
+        } else {
+            this->filter.plan(&this->carData, this->decoder->getSignals(),
+                    this->decoder->size());
+            this->filter.apply(this->can);
+        }
+    }
+
+    void detachReceiveInterrupt() {
+        if (!this->isInterruptAttached) {
+            return;
+        }
+
+        uint8_t pin = this->canInterruptPin;
+        int interrupt = digitalPinToInterrupt(pin);
+        if (interrupt != NOT_AN_INTERRUPT) {
+            detachInterrupt(interrupt);
+            SPI.notUsingInterrupt(interrupt);
+        } else {
+            *digitalPinToPCMSK(pin) &= ~bit(digitalPinToPCMSKbit(pin));
+            SPI.notUsingInterrupt(255);
+        }
+        this->isInterruptAttached = false;
+        if (interruptCan == this) {
+            interruptCan = NULL;
+        }
+    }
+
+    bool canSendBulk(uint8_t length) {
+        return !this->queue || this->queue->canSend(length);
+    }
+
+    /*
+     * Sends the latest value of every pending CarData the serial can take
+     * right now. Starts where the last call stopped, so no CAN ID starves.
+     */
+    void sendPendingData() {
+        if (!this->hasPendingData) {
+            return;
+        }
+
+        uint8_t size = this->carData.size();
+        SerialFrame<CAN_AGGREGATE_FRAME_SIZE> aggregate(0x62,
+                this->isDelta ? 0x04 : 0x02);
+        bool isComplete = true;
+        uint16_t now = millis();
+        uint32_t sentAt = micros();
+        for (uint8_t n = 0; n < size; n++) {
+            uint8_t index = (this->pendingCursor + n) % size;
+            CarData * data = this->carData.get(index);
+            if (!data->isPending()) {
+                continue;
+            }
+            CarDataTiming * timing = this->carData.getTiming(index);
+            if (!timing->isDue(now)) {
+                // Keeps coalescing until its interval has passed
+                isComplete = false;
+                continue;
+            }
+
+            // Extended IDs are always sent as full updates in their own frame
+            bool isDelta = this->isDelta && data->isDeltaCapable();
+            bool isAggregated = this->isAggregating && isDelta == this->isDelta;
+            uint8_t entryLength = isDelta ?
+                    data->getDeltaLength() : data->getLength() + 4;
+            uint8_t needed = entryLength + 5;
+            if (isAggregated) {
+                if (!isDelta) {
+                    // Full entries carry their number of bytes
+                    needed++;
+                }
+                if (this->isTimestamped) {
+                    needed += 2;
+                }
+                if (aggregate.getPayloadSize() + needed
+                        > CAN_AGGREGATE_FRAME_SIZE) {
+                    aggregate.send(this->bulk);
+                    aggregate.clear();
+                }
+                if (this->isTimestamped && aggregate.getPayloadSize() == 0) {
+                    needed += 4;
+                }
+                needed += aggregate.getPayloadSize();
+            } else if (aggregate.getPayloadSize() > 0) {
+                // The unsent aggregate goes out first
+                needed += aggregate.getPayloadSize() + 5;
+            }
+            if (!this->canSendBulk(needed)) {
+                isComplete = false;
+                this->pendingCursor = index;
+                break;
+            }
+
+            if (isAggregated && this->isTimestamped) {
+                if (aggregate.getPayloadSize() == 0) {
+                    aggregate.appendLong(sentAt);
+                }
+                aggregate.appendShort(timing->getAge(sentAt));
+            }
+            if (isAggregated && isDelta) {
+                data->appendDeltaTo(&aggregate);
+            } else if (isAggregated) {
+                this->appendAggregate(&aggregate, data);
+            } else {
+                if (aggregate.getPayloadSize() > 0) {
+                    aggregate.send(this->bulk);
+                    aggregate.clear();
+                }
+                if (isDelta) {
+                    data->serializeDelta(this->bulk);
+                } else {
+                    data->serialize(this->bulk);
+                }
+            }
+            data->markSent();
+            timing->markSent(now);
+        }
+
+        // Every check above counted the unsent aggregate, so it fits
+        if (aggregate.getPayloadSize() > 0) {
+            aggregate.send(this->bulk);
+        }
+        this->hasPendingData = !isComplete;
+    }
+
+    /*
+     * Sends as many snapshot frames as the serial can take right now. Each
+     * starts with a flags byte, CAN_SNAPSHOT_LAST marks the last one, and
+     * holds entries like an aggregate. An empty table still gets its last
+     * frame.
+     */
+    void sendSnapshot() {
+        if (!this->isSnapshotPending) {
+            return;
+        }
+
+        uint8_t size = this->carData.size();
+        while (true) {
+            // Entries that fit into the next frame
+            uint8_t end = this->snapshotCursor;
+            uint8_t length = 1;
+            for (; end < size; end++) {
+                CarData * data = this->carData.get(end);
+                if (!data->hasValue()) {
+                    continue;
+                }
+                uint8_t entryLength = 5 + data->getLength();
+                if (length + entryLength > CAN_AGGREGATE_FRAME_SIZE - 5) {
+                    break;
+                }
+                length += entryLength;
+            }
+            if (!this->canSendBulk(length + 5)) {
+                return;
+            }
+
+            SerialFrame<CAN_AGGREGATE_FRAME_SIZE> frame(0x62, 0x05);
+            frame.append(end >= size ? CAN_SNAPSHOT_LAST : 0);
+            for (uint8_t i = this->snapshotCursor; i < end; i++) {
+                CarData * data = this->carData.get(i);
+                if (data->hasValue()) {
+                    this->appendAggregate(&frame, data);
+                }
+            }
+            frame.send(this->bulk);
+            this->snapshotCursor = end;
+            if (end >= size) {
+                this->isSnapshotPending = false;
+                return;
+            }
+        }
+    }
+
+    /* Aggregate entries are the CAN ID, the number of bytes and the bytes */
+    bool appendAggregate(SerialFrame<CAN_AGGREGATE_FRAME_SIZE> * aggregate,
+            CarData * data) {
+        if (aggregate->available() < 5 + data->getLength()) {
+            return false;
+        }
+        aggregate->append(data->getLength());
+        return data->appendTo(aggregate);
     }
 };
 
+static void onCanInterrupt() {
+    if (interruptCan) {
+        interruptCan->receive();
+    }
+}
+
+#ifndef CAN_NO_PCINT_ISR
+// Any change of a pin of the port ends up here, receive() checks the level
+ISR(CAN_PCINT_VECTOR(CAN_PCINT_PORT)) {
+    onCanInterrupt();
+}
+#endif
+
 #endif /* CAN_H_ */
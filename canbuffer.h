@@ -0,0 +1,71 @@
+#ifndef CANBUFFER_H_
+#define CANBUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compiler barrier. Keeps frame contents and index updates in order, so the
+ * consumer never sees a published slot before its data has been written.
+ */
+#define CAN_BUFFER_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+struct CanFrame {
+    uint32_t timestamp;
+    uint32_t id;
+    uint8_t length;
+    uint8_t data[8];
+};
+
+/************************************************************************
+ * Lock-free single-producer/single-consumer ring of CAN frames.
+ *
+ * The producer (the CAN interrupt) only ever moves the head, the consumer
+ * (the main loop) only ever moves the tail. Both indices are single bytes,
+ * so they are read and written atomically on AVR without disabling
+ * interrupts.
+ *
+ * Producer: reserve() a slot, fill it, then commit() it.
+ * Consumer: peek() the oldest frame, process it, then release() it.
+ */
+template<uint8_t SIZE>
+class CanFrameBuffer {
+    static_assert(SIZE > 0 && SIZE <= 128 && (SIZE & (SIZE - 1)) == 0,
+            "CanFrameBuffer size must be a power of two up to 128");
+public:
+    CanFrame * reserve() {
+        if ((uint8_t) (this->head - this->tail) >= SIZE) {
+            return NULL;
+        }
+        return &this->frames[this->head & (SIZE - 1)];
+    }
+    void commit() {
+        CAN_BUFFER_BARRIER();
+        this->head = this->head + 1;
+    }
+    const CanFrame * peek() {
+        if (this->head == this->tail) {
+            return NULL;
+        }
+        CAN_BUFFER_BARRIER();
+        return &this->frames[this->tail & (SIZE - 1)];
+    }
+    void release() {
+        CAN_BUFFER_BARRIER();
+        this->tail = this->tail + 1;
+    }
+    uint8_t count() {
+        return this->head - this->tail;
+    }
+    /* Releases every frame, so it is on the consumer side as well */
+    void clear() {
+        CAN_BUFFER_BARRIER();
+        this->tail = this->head;
+    }
+private:
+    CanFrame frames[SIZE];
+    volatile uint8_t head = 0;
+    volatile uint8_t tail = 0;
+};
+
+#endif /* CANBUFFER_H_ */
@@ -0,0 +1,193 @@
+#ifndef CANFILTER_H_
+#define CANFILTER_H_
+
+#include <mcp_can.h>
+#include "carsystems.h"
+#include "cansignal.h"
+
+#define CAN_STANDARD_ID_MASK 0x07FF
+
+/************************************************************************
+ * Works out the MCP2515 acceptance masks and filters for a set of CAN IDs.
+ *
+ * The MCP2515 has two receive buffers: buffer 0 with mask 0 and filters
+ * 0-1, buffer 1 with mask 1 and filters 2-5. The IDs are taken in ascending
+ * order and merged into at most six groups (whenever a seventh comes up,
+ * the two neighbouring groups that add the fewest accepted IDs are joined),
+ * then the groups are split between both buffers so the shared masks
+ * accept as few IDs as possible. Planning needs no more memory than the
+ * seven groups, however many IDs there are.
+ *
+ * CAN IDs of decoded signals are accepted alongside the subscriptions.
+ *
+ * Only standard IDs are filtered in hardware. If extended IDs are subscribed
+ * the controller is opened up and filtering is done in software only.
+ * Software filtering always stays in place, the hardware filters only keep
+ * the bulk of unwanted frames off the SPI bus.
+ */
+class CanFilter {
+private:
+    struct Group {
+        uint16_t filter;
+        uint16_t care;
+    };
+
+    uint16_t masks[2] = { 0, 0 };
+    uint16_t filters[6] = { 0, 0, 0, 0, 0, 0 };
+    bool isFiltering = false;
+
+    static uint8_t countBits(uint16_t value) {
+        uint8_t count = 0;
+        while (value) {
+            value &= value - 1;
+            count++;
+        }
+        return count;
+    }
+
+    /* Number of standard IDs accepted by a filter using the given mask */
+    static uint16_t acceptedIds(uint16_t care) {
+        return 1 << (11 - countBits(care));
+    }
+
+    static Group merge(Group a, Group b) {
+        Group merged;
+        merged.care = a.care & b.care & ~(a.filter ^ b.filter);
+        merged.filter = a.filter & merged.care;
+        return merged;
+    }
+public:
+    /*
+     * Plans the filters for the given subscriptions and signals. Returns
+     * false when the controller has to accept every frame.
+     */
+    bool plan(CarDataTable * table, const CanSignal * signals = NULL,
+            uint8_t signalCount = 0) {
+        this->isFiltering = false;
+
+        // Takes the IDs in ascending order and joins neighbouring groups as
+        // soon as there are more than six, so only seven groups are kept
+        Group groups[7];
+        uint8_t count = 0;
+        uint8_t next = 0;
+        uint32_t lastId = 0;
+        bool hasLastId = false;
+        while (true) {
+            // Lowest ID of the subscriptions and signals not taken yet
+            bool isFound = next < table->size();
+            uint32_t canId = isFound ? table->get(next)->getCanId() : 0;
+            for (uint8_t s = 0; s < signalCount; s++) {
+                uint32_t signalId = signals[s].canId;
+                if ((!hasLastId || signalId > lastId)
+                        && (!isFound || signalId < canId)) {
+                    canId = signalId;
+                    isFound = true;
+                }
+            }
+            if (!isFound) {
+                break;
+            }
+            // Signals of a subscribed ID are taken with the subscription
+            if (next < table->size() && table->get(next)->getCanId() == canId) {
+                next++;
+            }
+            if (canId > CAN_STANDARD_ID_MASK) {
+                return false;
+            }
+            lastId = canId;
+            hasLastId = true;
+
+            groups[count].filter = canId;
+            groups[count].care = CAN_STANDARD_ID_MASK;
+            if (++count <= 6) {
+                continue;
+            }
+            uint8_t bestIndex = 0;
+            int16_t bestCost = 0x7FFF;
+            for (uint8_t i = 0; i < count - 1; i++) {
+                int16_t cost = acceptedIds(merge(groups[i], groups[i + 1]).care)
+                        - acceptedIds(groups[i].care)
+                        - acceptedIds(groups[i + 1].care);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestIndex = i;
+                }
+            }
+            groups[bestIndex] = merge(groups[bestIndex], groups[bestIndex + 1]);
+            count--;
+            for (uint8_t i = bestIndex + 1; i < count; i++) {
+                groups[i] = groups[i + 1];
+            }
+        }
+        if (count < 1) {
+            return false;
+        }
+
+        // Unused filters repeat the last group
+        for (uint8_t i = count; i < 6; i++) {
+            groups[i] = groups[count - 1];
+        }
+
+        // Pick the two groups for buffer 0 that keep both masks tightest
+        uint32_t bestCost = 0xFFFFFFFF;
+        for (uint8_t first = 0; first < 5; first++) {
+            for (uint8_t second = first + 1; second < 6; second++) {
+                uint16_t mask0 = groups[first].care & groups[second].care;
+                uint16_t mask1 = CAN_STANDARD_ID_MASK;
+                for (uint8_t i = 0; i < 6; i++) {
+                    if (i != first && i != second) {
+                        mask1 &= groups[i].care;
+                    }
+                }
+                uint32_t cost = 2UL * acceptedIds(mask0) + 4UL * acceptedIds(mask1);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    this->masks[0] = mask0;
+                    this->masks[1] = mask1;
+                    this->filters[0] = groups[first].filter & mask0;
+                    this->filters[1] = groups[second].filter & mask0;
+                    uint8_t filterIndex = 2;
+                    for (uint8_t i = 0; i < 6; i++) {
+                        if (i != first && i != second) {
+                            this->filters[filterIndex++] = groups[i].filter & mask1;
+                        }
+                    }
+                }
+            }
+        }
+
+        this->isFiltering = true;
+        return true;
+    }
+
+    /* Writes the planned masks and filters, or opens the controller up */
+    void apply(MCP_CAN * can) {
+        if (!this->isFiltering) {
+            open(can);
+            return;
+        }
+
+        // Standard IDs live in the upper 16 bits, the lower bits would match data bytes
+        can->init_Mask(0, 0, (uint32_t) this->masks[0] << 16);
+        can->init_Mask(1, 0, (uint32_t) this->masks[1] << 16);
+        for (uint8_t i = 0; i < 6; i++) {
+            can->init_Filt(i, 0, (uint32_t) this->filters[i] << 16);
+        }
+    }
+
+    /* Accepts all standard and extended frames */
+    static void open(MCP_CAN * can) {
+        can->init_Mask(0, 0, 0);
+        can->init_Mask(1, 0, 0);
+        for (uint8_t i = 0; i < 6; i++) {
+            // Filters only apply to one frame type, so alternate them
+            can->init_Filt(i, i & 1, 0);
+        }
+    }
+
+    bool isHardwareFiltering() {
+        return this->isFiltering;
+    }
+};
+
+#endif /* CANFILTER_H_ */
@@ -0,0 +1,241 @@
+#ifndef CANREPLAY_H_
+#define CANREPLAY_H_
+
+#include "Arduino.h"
+#include "canbuffer.h"
+#include "can.h"
+
+#ifndef CAN_REPLAY_LINE_SIZE
+#define CAN_REPLAY_LINE_SIZE 64
+#endif
+
+/************************************************************************
+ * Replays a candump log (candump -l) into a Can.
+ *
+ * Lines look like "(1436509052.249713) can0 60D#0006000000000000". Frames
+ * are injected into the receive buffer of the Can, so they take the same
+ * path through updateFromCan as frames from the bus. The time between
+ * frames is kept, divided by the speed. With speed 0 every frame is
+ * injected as soon as it is read. Frames are time stamped with the time
+ * they were due, so at speed 10 the sketch sees the trace ten times as
+ * fast, intervals and rate limits included. Lines that are not CAN data
+ * frames (remote frames, CAN FD, comments) are skipped.
+ *
+ * update() never blocks: it reads what the input has available and
+ * injects the frames that are due.
+ */
+class CanReplay {
+private:
+    Stream * input;
+    Can * can;
+    uint8_t speed = 1;
+    char line[CAN_REPLAY_LINE_SIZE];
+    uint8_t lineLength = 0;
+    bool isLineTooLong = false;
+
+    CanFrame pending;
+    bool hasPending = false;
+    bool isStarted = false;
+    uint32_t traceSeconds = 0;
+    uint32_t traceMicros = 0;
+    uint32_t replayStart = 0;
+    uint32_t replayedCount = 0;
+
+    static int8_t hexDigit(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        return -1;
+    }
+
+    bool isDue(uint32_t frameTime) {
+        if (this->speed == 0) {
+            return true;
+        }
+        uint32_t elapsed = (uint32_t) micros() - this->replayStart;
+        return elapsed >= frameTime / this->speed;
+    }
+
+    void readLine() {
+        while (!this->hasPending && this->input->available() > 0) {
+            char c = this->input->read();
+            if (c != '\n') {
+                if (this->lineLength < CAN_REPLAY_LINE_SIZE - 1) {
+                    this->line[this->lineLength++] = c;
+                } else {
+                    this->isLineTooLong = true;
+                }
+                continue;
+            }
+
+            this->line[this->lineLength] = '\0';
+            if (!this->isLineTooLong) {
+                this->hasPending = this->parseLine();
+            }
+            this->lineLength = 0;
+            this->isLineTooLong = false;
+        }
+    }
+
+    /* Parses the current line into the pending frame */
+    bool parseLine() {
+        uint32_t seconds = 0;
+        uint32_t fraction = 0;
+        if (!parse(this->line, &this->pending, &seconds, &fraction)) {
+            return false;
+        }
+
+        // Frame times are kept relative to the first frame of the trace
+        if (!this->isStarted) {
+            this->isStarted = true;
+            this->traceSeconds = seconds;
+            this->traceMicros = fraction;
+            this->replayStart = micros();
+        }
+        // Trace time of the frame, relative to the first one
+        this->pending.timestamp = (seconds - this->traceSeconds) * 1000000UL
+                + fraction - this->traceMicros;
+        return true;
+    }
+public:
+    CanReplay(Stream * input, Can * can) {
+        this->input = input;
+        this->can = can;
+    }
+
+    /* 1 replays in original time, 10 ten times as fast, 0 without delays */
+    void setSpeed(uint8_t speed) {
+        this->speed = speed;
+    }
+
+    /* Starts over with the next line read from the input */
+    void restart() {
+        this->lineLength = 0;
+        this->isLineTooLong = false;
+        this->hasPending = false;
+        this->isStarted = false;
+    }
+
+    /* Injects every frame that is due, returns false once nothing is left */
+    bool update() {
+        while (true) {
+            this->readLine();
+            if (!this->hasPending || !this->isDue(this->pending.timestamp)) {
+                break;
+            }
+            CanFrame frame = this->pending;
+            if (this->speed > 0) {
+                frame.timestamp = this->replayStart
+                        + frame.timestamp / this->speed;
+            }
+            // Without a speed the frame is stamped when it is injected
+            if (!this->can->inject(&frame, this->speed > 0)) {
+                // Receive buffer full, try again after the next update
+                break;
+            }
+            this->hasPending = false;
+            this->replayedCount++;
+        }
+        return this->hasPending || this->input->available() > 0;
+    }
+
+    uint32_t getReplayedCount() {
+        return this->replayedCount;
+    }
+
+    /*
+     * Parses one candump log line into the frame and its time stamp
+     * (seconds and micros). The time stamp in parentheses is optional,
+     * lines without one are due at once.
+     */
+    static bool parse(const char * text, CanFrame * frame, uint32_t * seconds,
+            uint32_t * fraction) {
+        *seconds = 0;
+        *fraction = 0;
+        while (*text == ' ' || *text == '\t') {
+            text++;
+        }
+        if (*text == '(') {
+            text++;
+            while (*text >= '0' && *text <= '9') {
+                *seconds = *seconds * 10 + (*text++ - '0');
+            }
+            if (*text++ != '.') {
+                return false;
+            }
+            // Fractions of other than six digits are scaled to micros
+            uint8_t digits = 0;
+            for (; *text >= '0' && *text <= '9'; digits++, text++) {
+                if (digits < 6) {
+                    *fraction = *fraction * 10 + (*text - '0');
+                }
+            }
+            if (digits == 0 || *text++ != ')') {
+                return false;
+            }
+            for (; digits < 6; digits++) {
+                *fraction *= 10;
+            }
+        }
+
+        // Interface name
+        while (*text == ' ' || *text == '\t') {
+            text++;
+        }
+        while (*text && *text != ' ' && *text != '\t') {
+            text++;
+        }
+        while (*text == ' ' || *text == '\t') {
+            text++;
+        }
+
+        // 3 hex digits are a standard ID, 8 an extended one
+        uint32_t canId = 0;
+        uint8_t idDigits = 0;
+        int8_t digit;
+        while ((digit = hexDigit(*text)) >= 0) {
+            canId = canId << 4 | digit;
+            text++;
+            idDigits++;
+        }
+        if ((idDigits != 3 && idDigits != 8) || *text != '#') {
+            return false;
+        }
+        text++;
+        // Flagged like MCP_CAN flags the extended IDs it receives
+        if (idDigits == 8) {
+            canId |= 0x80000000;
+        }
+
+        uint8_t length = 0;
+        while (*text && *text != '\r') {
+            if (*text == '.') {
+                text++;
+                continue;
+            }
+            int8_t high = hexDigit(text[0]);
+            int8_t low = high < 0 ? -1 : hexDigit(text[1]);
+            if (low < 0 || length >= 8) {
+                // Remote frames, CAN FD and anything else malformed
+                return false;
+            }
+            frame->data[length++] = high << 4 | low;
+            text += 2;
+        }
+
+        frame->id = canId;
+        frame->length = length;
+        for (uint8_t i = length; i < 8; i++) {
+            frame->data[i] = 0;
+        }
+        return true;
+    }
+};
+
+#endif /* CANREPLAY_H_ */
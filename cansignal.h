@@ -0,0 +1,220 @@
+#ifndef CANSIGNAL_H_
+#define CANSIGNAL_H_
+
+#include <string.h>
+#include "Arduino.h"
+#include "serialpacket.h"
+#include "serialqueue.h"
+
+// 5 bytes of RAM each, whether used or not
+#ifndef CAN_MAX_SIGNALS
+#define CAN_MAX_SIGNALS 8
+#endif
+
+#ifndef CAN_SIGNAL_FRAME_SIZE
+#define CAN_SIGNAL_FRAME_SIZE 48
+#endif
+
+enum CanByteOrder {
+    // Motorola: bit 0 is the MSB of byte 0, the start bit is the signal's MSB
+    CAN_MSB_FIRST,
+    // Intel: bit 0 is the LSB of byte 0, the start bit is the signal's LSB
+    CAN_LSB_FIRST
+};
+
+/*
+ * A signal inside the data of a CAN ID. The engineering value is
+ * raw * factor + offset.
+ */
+struct CanSignal {
+    uint32_t canId;
+    int32_t (*extract)(const uint8_t data[8]);
+    uint8_t minLength;
+    float factor;
+    float offset;
+};
+
+/************************************************************************
+ * Compile-time layout of a CAN signal of up to 32 bits.
+ *
+ * Position, length, byte order and signedness are template arguments, so
+ * extract() compiles to a few loads, shifts and masks without any loops or
+ * branches left at runtime. A signal may span at most four bytes.
+ *
+ *   static const CanSignal signals[] = {
+ *       CanSignalLayout<14, 1>::signal(0x60D),
+ *       CanSignalLayout<16, 12, CAN_LSB_FIRST, true>::signal(0x180, 0.1, -40)
+ *   };
+ */
+template<uint8_t START_BIT, uint8_t LENGTH, CanByteOrder ORDER = CAN_MSB_FIRST,
+        bool IS_SIGNED = false>
+struct CanSignalLayout {
+    enum {
+        firstByte = START_BIT / 8,
+        lastByte = (START_BIT + LENGTH - 1) / 8,
+        // Motorola signals end lastBit bits into their last byte
+        lastBit = (START_BIT + LENGTH - 1) & 7
+    };
+    static_assert(LENGTH >= 1 && LENGTH <= 32,
+            "CAN signals must be 1 to 32 bits long");
+    static_assert(START_BIT + LENGTH <= 64 && lastByte - firstByte < 4,
+            "CAN signals must fit into the frame and span at most 4 bytes");
+
+    static int32_t extract(const uint8_t data[8]) {
+        const uint32_t mask = (uint32_t) ((1ULL << LENGTH) - 1);
+        uint32_t raw = 0;
+        if (ORDER == CAN_MSB_FIRST) {
+            for (uint8_t i = firstByte; i <= lastByte; i++) {
+                raw = raw << 8 | data[i];
+            }
+            raw = raw >> (7 - lastBit) & mask;
+        } else {
+            for (uint8_t i = lastByte + 1; i-- > firstByte;) {
+                raw = raw << 8 | data[i];
+            }
+            raw = raw >> (START_BIT & 7) & mask;
+        }
+        if (IS_SIGNED && LENGTH < 32 && (raw & (1UL << (LENGTH - 1)))) {
+            raw |= ~mask;
+        }
+        return (int32_t) raw;
+    }
+
+    static constexpr CanSignal signal(uint32_t canId, float factor = 1,
+            float offset = 0) {
+        return CanSignal { canId, &extract, lastByte + 1, factor, offset };
+    }
+};
+
+/************************************************************************
+ * Decodes configured signals from received CAN frames and sends their
+ * engineering values when they change.
+ *
+ * Values go out as 0x62 0x10 frames holding one entry per changed signal:
+ * the index of the signal (1 byte) and its value as a big-endian IEEE 754
+ * float (4 bytes). Changes are detected on the raw value. While the serial
+ * is busy only the latest value of each signal is kept.
+ */
+class CanSignalDecoder {
+private:
+    struct State {
+        int32_t raw;
+        uint8_t flags;
+    };
+    enum {
+        HAS_VALUE = 0x01, PENDING = 0x02
+    };
+
+    Stream * serial;
+    Stream * output;
+    SerialQueue * queue = NULL;
+    const CanSignal * signals = NULL;
+    State states[CAN_MAX_SIGNALS];
+    uint8_t count = 0;
+    bool hasPending = false;
+
+    bool canSend(uint8_t length) {
+        return !this->queue || this->queue->canSend(length);
+    }
+public:
+    CanSignalDecoder(Stream * serial) {
+        this->serial = serial;
+        this->output = serial;
+    }
+    void setSerialQueue(SerialQueue * queue) {
+        this->queue = queue;
+        this->output = queue ?
+                queue->getStream(SerialQueue::BULK) : this->serial;
+    }
+    /* The signals are not copied and have to outlive the decoder */
+    void setSignals(const CanSignal * signals, uint8_t count) {
+        this->signals = signals;
+        this->count = count < CAN_MAX_SIGNALS ? count : CAN_MAX_SIGNALS;
+        this->hasPending = false;
+        memset(this->states, 0, sizeof(this->states));
+    }
+    const CanSignal * getSignals() {
+        return this->signals;
+    }
+    uint8_t size() {
+        return this->count;
+    }
+    /* Returns true if any signal belongs to the CAN ID */
+    bool decode(uint32_t canId, const uint8_t data[8], uint8_t length) {
+        bool isMatched = false;
+        for (uint8_t i = 0; i < this->count; i++) {
+            const CanSignal * signal = &this->signals[i];
+            if (signal->canId != canId) {
+                continue;
+            }
+            isMatched = true;
+            if (length < signal->minLength) {
+                continue;
+            }
+
+            int32_t raw = signal->extract(data);
+            State * state = &this->states[i];
+            if (!(state->flags & HAS_VALUE) || state->raw != raw) {
+                state->raw = raw;
+                state->flags |= HAS_VALUE | PENDING;
+                this->hasPending = true;
+            }
+        }
+        return isMatched;
+    }
+    /* Sends every known value again with the next flush */
+    void requestRefresh() {
+        for (uint8_t i = 0; i < this->count; i++) {
+            if (this->states[i].flags & HAS_VALUE) {
+                this->states[i].flags |= PENDING;
+                this->hasPending = true;
+            }
+        }
+    }
+    /* Sends pending values as far as the serial has room right now */
+    void flush() {
+        if (!this->hasPending) {
+            return;
+        }
+
+        SerialFrame<CAN_SIGNAL_FRAME_SIZE> frame(0x62, 0x10);
+        bool isComplete = true;
+        for (uint8_t i = 0; i < this->count; i++) {
+            State * state = &this->states[i];
+            if (!(state->flags & PENDING)) {
+                continue;
+            }
+            if (frame.available() < 5) {
+                if (!this->canSend(frame.getPayloadSize() + 5)) {
+                    isComplete = false;
+                    break;
+                }
+                frame.send(this->output);
+                frame.clear();
+            }
+
+            const CanSignal * signal = &this->signals[i];
+            float value = state->raw * signal->factor + signal->offset;
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            frame.append(i);
+            frame.appendLong(bits);
+            state->flags &= ~PENDING;
+        }
+
+        if (frame.getPayloadSize() > 0) {
+            if (this->canSend(frame.getPayloadSize() + 5)) {
+                frame.send(this->output);
+            } else {
+                // Keep the values pending for the next attempt
+                for (uint8_t i = 0; i < frame.getPayloadSize(); i += 5) {
+                    this->states[frame.getPayload()[i]].flags |= PENDING;
+                }
+                isComplete = false;
+            }
+        }
+        this->hasPending = !isComplete;
+    }
+};
+
+#endif /* CANSIGNAL_H_ */
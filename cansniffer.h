@@ -0,0 +1,220 @@
+#ifndef CANSNIFFER_H_
+#define CANSNIFFER_H_
+
+#include "serialpacket.h"
+#include "serialqueue.h"
+
+// Sniffer modes, combined as flags
+#define CAN_SNIFF_BATCH 0x01
+#define CAN_SNIFF_CHANGES 0x02
+#define CAN_SNIFF_TIMESTAMPS 0x04
+
+#ifndef CAN_SNIFF_FRAME_SIZE
+#define CAN_SNIFF_FRAME_SIZE 63
+#endif
+
+#ifndef CAN_SNIFF_HISTORY_SIZE
+#define CAN_SNIFF_HISTORY_SIZE 8
+#endif
+
+/************************************************************************
+ * Sends sniffed CAN frames to the serial.
+ *
+ * By default every frame is sent as its own 0x62 0x6d frame. In batch mode
+ * frames are packed into 0x62 0x6e frames. Their payload starts with the
+ * number of frames dropped since the previous batch (2 bytes), followed by
+ * one entry per CAN frame: a header of 2 bytes (data length in bits 12-15,
+ * extended flag in bit 11, standard ID in bits 0-10), the 4 byte ID for
+ * extended frames only, and the data bytes.
+ *
+ * With CAN_SNIFF_TIMESTAMPS a batch additionally carries the capture time
+ * of its first frame in micros (4 bytes) after the drop count, and every
+ * entry carries the time since the previous entry in micros (2 bytes,
+ * saturating) right after its ID.
+ *
+ * With CAN_SNIFF_CHANGES only frames with a payload different from the last
+ * one seen for that ID are sent. Payloads are remembered as a CRC-16 in
+ * a small direct mapped table, which is cleared whenever the mode is set.
+ * The batch and the table are members, so nothing is allocated.
+ *
+ * Frames are dropped (and counted) instead of blocking when the serial can
+ * not keep up.
+ */
+class CanSniffer {
+private:
+    struct History {
+        uint32_t canId;
+        uint16_t checksum;
+    };
+
+    Stream * serial;
+    Stream * output;
+    SerialQueue * queue = NULL;
+    SerialFrame<CAN_SNIFF_FRAME_SIZE> batch { 0x62, 0x6e };
+    History history[CAN_SNIFF_HISTORY_SIZE];
+    bool isBatching = false;
+    bool isSkippingUnchanged = false;
+    bool isTimestamped = false;
+    uint32_t lastTimestamp = 0;
+    uint16_t unreportedDrops = 0;
+    uint32_t droppedCount = 0;
+
+    bool canSend(uint8_t length) {
+        return !this->queue || this->queue->canSend(length);
+    }
+
+    void report(uint16_t count) {
+        uint16_t room = 0xFFFF - this->unreportedDrops;
+        this->unreportedDrops += count < room ? count : room;
+    }
+
+    void drop(uint16_t count) {
+        this->droppedCount += count;
+        statistics.add(Statistics::FRAMES_DROPPED, count);
+        this->report(count);
+    }
+
+    static uint16_t checksum(uint8_t data[], uint8_t length) {
+        /*
+         * CRC-16/CCITT over the length and the data bytes. Fletcher-16 sums
+         * modulo 255, so it took a byte going from 0x00 to 0xFF as unchanged.
+         */
+        uint16_t crc = 0xFFFF;
+        for (int8_t i = -1; i < (int8_t) length; i++) {
+            crc ^= (uint16_t) (i < 0 ? length : data[i]) << 8;
+            for (uint8_t bit = 0; bit < 8; bit++) {
+                crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+            }
+        }
+        return crc;
+    }
+
+    /* Returns true if the ID was seen with the same payload before */
+    bool isUnchanged(uint32_t canId, uint8_t data[], uint8_t length) {
+        History * slot = &this->history[(canId ^ canId >> 5)
+                % CAN_SNIFF_HISTORY_SIZE];
+        uint16_t sum = checksum(data, length);
+        if (slot->canId == canId && slot->checksum == sum) {
+            return true;
+        }
+        slot->canId = canId;
+        slot->checksum = sum;
+        return false;
+    }
+
+    void startBatch() {
+        this->batch.clear();
+        this->batch.appendShort(this->unreportedDrops);
+        this->unreportedDrops = 0;
+    }
+
+    void sendSingle(uint32_t canId, uint8_t data[], uint8_t length) {
+        if (!this->canSend(length + 9)) {
+            this->drop(1);
+            return;
+        }
+        SerialFrame<17> frame(0x62, 0x6d);
+        frame.appendLong(canId);
+        frame.append(data, length);
+        frame.send(this->output);
+    }
+public:
+    CanSniffer(Stream * serial) {
+        this->serial = serial;
+        this->output = serial;
+    }
+    void setSerialQueue(SerialQueue * queue) {
+        this->queue = queue;
+        this->output = queue ?
+                queue->getStream(SerialQueue::BULK) : this->serial;
+    }
+    void setMode(uint8_t mode) {
+        this->isBatching = mode & CAN_SNIFF_BATCH;
+        this->isSkippingUnchanged = mode & CAN_SNIFF_CHANGES;
+        this->isTimestamped = mode & CAN_SNIFF_TIMESTAMPS;
+
+        if (this->isBatching) {
+            this->startBatch();
+        }
+        if (this->isSkippingUnchanged) {
+            memset(this->history, 0xFF, sizeof(this->history));
+        }
+    }
+    void sniff(uint32_t canId, uint8_t data[], uint8_t length,
+            uint32_t timestamp) {
+        if (length > 8) {
+            length = 8;
+        }
+        if (this->isSkippingUnchanged && this->isUnchanged(canId, data, length)) {
+            return;
+        }
+        if (!this->isBatching) {
+            this->sendSingle(canId, data, length);
+            return;
+        }
+
+        bool isExtended = canId > 0x07FF;
+        uint8_t entryLength = 2 + (isExtended ? 4 : 0) + length;
+        if (this->isTimestamped) {
+            entryLength += 2;
+        }
+        if (this->batch.available() < entryLength) {
+            this->flush();
+        }
+        if (this->isTimestamped && this->batch.getPayloadSize() == 2) {
+            this->batch.appendLong(timestamp);
+            this->lastTimestamp = timestamp;
+        }
+
+        uint16_t header = (uint16_t) length << 12;
+        if (isExtended) {
+            this->batch.appendShort(header | 0x0800);
+            this->batch.appendLong(canId);
+        } else {
+            this->batch.appendShort(header | canId);
+        }
+        if (this->isTimestamped) {
+            uint32_t delta = timestamp - this->lastTimestamp;
+            this->batch.appendShort(delta > 0xFFFF ? 0xFFFF : delta);
+            this->lastTimestamp = timestamp;
+        }
+        this->batch.append(data, length);
+    }
+    /* Sends the current batch, or drops it if the serial is busy */
+    void flush() {
+        if (!this->isBatching || this->batch.getPayloadSize() <= 2) {
+            return;
+        }
+
+        if (this->canSend(this->batch.getPayloadSize() + 5)) {
+            this->batch.send(this->output);
+            this->startBatch();
+        } else {
+            // Count the dropped entries by walking their headers
+            uint8_t payloadSize = this->batch.getPayloadSize();
+            const uint8_t * payload = this->batch.getPayload();
+            uint8_t timestampLength = this->isTimestamped ? 2 : 0;
+            uint16_t count = 0;
+            for (uint8_t index = 2 + 2 * timestampLength;
+                    index + 1 < payloadSize; count++) {
+                uint16_t header = (uint16_t) payload[index] << 8 | payload[index + 1];
+                index += 2 + (header >> 12) + (header & 0x0800 ? 4 : 0)
+                        + timestampLength;
+            }
+            // The drops this batch should have reported are still unreported
+            this->report((uint16_t) payload[0] << 8 | payload[1]);
+            this->drop(count);
+            this->startBatch();
+        }
+    }
+    /* Reports frames lost before they reached the sniffer with the next batch */
+    void addDropped(uint16_t count) {
+        this->report(count);
+    }
+    /* Number of sniffed frames dropped because the serial was busy */
+    uint32_t getDroppedCount() {
+        return this->droppedCount;
+    }
+};
+
+#endif /* CANSNIFFER_H_ */
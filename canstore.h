@@ -0,0 +1,130 @@
+#ifndef CANSTORE_H_
+#define CANSTORE_H_
+
+#include <EEPROM.h>
+#include "carsystems.h"
+
+#define CAN_STORE_VERSION 0x01
+#define CAN_STORE_HEADER_SIZE 4
+#define CAN_STORE_ENTRY_SIZE 7
+
+/************************************************************************
+ * Keeps the CAN subscriptions in EEPROM across resets.
+ *
+ * Layout from the given address: version (1 byte), number of entries
+ * (1 byte), Fletcher-16 checksum over the count and the entries (2 bytes),
+ * then per entry the CAN ID (4 bytes), the mask (1 byte) and the interval
+ * (2 bytes), all big-endian. Bytes are written with EEPROM.update, so
+ * saving an unchanged table does not wear the EEPROM. A save is split into
+ * steps of one entry, so it never stalls the caller for the whole table.
+ */
+class CanStore {
+private:
+    struct Checksum {
+        uint16_t sum1 = 0;
+        uint16_t sum2 = 0;
+        void add(uint8_t value) {
+            // Both sums stay below 255, so a subtraction replaces % 255
+            this->sum1 += value;
+            if (this->sum1 >= 255) {
+                this->sum1 -= 255;
+            }
+            this->sum2 += this->sum1;
+            if (this->sum2 >= 255) {
+                this->sum2 -= 255;
+            }
+        }
+        void add(uint32_t value, uint8_t length) {
+            for (uint8_t i = 0; i < length; i++) {
+                this->add((uint8_t) (value >> (8 * (length - 1 - i))));
+            }
+        }
+        uint16_t get() {
+            return this->sum2 << 8 | this->sum1;
+        }
+    };
+
+    static uint32_t readValue(int address, uint8_t length) {
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < length; i++) {
+            value = value << 8 | EEPROM.read(address + i);
+        }
+        return value;
+    }
+
+    static void writeValue(int address, uint32_t value, uint8_t length) {
+        for (uint8_t i = 0; i < length; i++) {
+            EEPROM.update(address + i, value >> (8 * (length - 1 - i)));
+        }
+    }
+public:
+    /* Number of EEPROM bytes needed for a full table */
+    static int size() {
+        return CAN_STORE_HEADER_SIZE + CAN_MAX_CAR_DATA * CAN_STORE_ENTRY_SIZE;
+    }
+
+    /* Replaces the table with the stored one, returns false if none is valid */
+    static bool load(CarDataTable * table, int address) {
+        uint8_t count = EEPROM.read(address + 1);
+        if (EEPROM.read(address) != CAN_STORE_VERSION
+                || count > CAN_MAX_CAR_DATA) {
+            return false;
+        }
+
+        // Check everything before touching the table
+        Checksum checksum;
+        checksum.add(count);
+        int entry = address + CAN_STORE_HEADER_SIZE;
+        for (uint16_t i = 0; i < count * CAN_STORE_ENTRY_SIZE; i++) {
+            checksum.add(EEPROM.read(entry + i));
+        }
+        uint16_t stored = EEPROM.read(address + 2) << 8
+                | EEPROM.read(address + 3);
+        if (checksum.get() != stored) {
+            return false;
+        }
+
+        table->clear();
+        for (uint8_t i = 0; i < count; i++) {
+            uint32_t canId = readValue(entry, 4);
+            uint8_t mask = readValue(entry + 4, 1);
+            uint16_t interval = readValue(entry + 5, 2);
+            table->add(canId, mask, interval);
+            entry += CAN_STORE_ENTRY_SIZE;
+        }
+        return true;
+    }
+
+    /*
+     * Writes one step of the table: the entry of the step, or the header
+     * once the step is past the last entry. Returns true after the header.
+     * The header and its checksum go last, so a save cut short by a reset
+     * fails the checksum instead of loading a mix of two tables.
+     */
+    static bool saveStep(CarDataTable * table, int address, uint8_t step) {
+        uint8_t count = table->size();
+        int entry = address + CAN_STORE_HEADER_SIZE;
+        if (step < count) {
+            CarData * data = table->get(step);
+            entry += step * CAN_STORE_ENTRY_SIZE;
+            writeValue(entry, data->getCanId(), 4);
+            writeValue(entry + 4, data->getMask(), 1);
+            writeValue(entry + 5, table->getTiming(step)->getInterval(), 2);
+            return false;
+        }
+
+        Checksum checksum;
+        checksum.add(count);
+        for (uint8_t i = 0; i < count; i++) {
+            checksum.add(table->get(i)->getCanId(), 4);
+            checksum.add(table->get(i)->getMask());
+            checksum.add(table->getTiming(i)->getInterval(), 2);
+        }
+        EEPROM.update(address, CAN_STORE_VERSION);
+        EEPROM.update(address + 1, count);
+        writeValue(address + 2, checksum.get(), 2);
+        return true;
+    }
+};
+
+#endif /* CANSTORE_H_ */
@@ -3,8 +3,11 @@
 
 #include <EEPROM.h>
 #include "serial.h"
+#include "serialqueue.h"
 #include "can.h"
 #include "power.h"
+#include "statistics.h"
+#include "baudrate.h"
 
 static SerialPacket baudRateReadError(0x65, 0x01);
 static SerialPacket carDataReadError(0x65, 0x02);
@@ -13,7 +16,7 @@ static SerialPacket tooManyFeaturesError(0x65, 0x04);
 static SerialPacket idChangeError(0x65, 0x05);
 
 union CarduinoPing {
-    unsigned char data[6] = { 0x01, 0x00, 0x00, 0x41, 0x41, 0x41 };
+    unsigned char data[6] = { 0x01, 0x01, 0x00, 0x41, 0x41, 0x41 };
     BitFieldMember<0, 8> major;
     BitFieldMember<8, 8> minor;
     BitFieldMember<16, 8> revision;
@@ -32,24 +35,77 @@ union CarduinoIdChange {
 static SerialDataPacket<CarduinoIdChange> idChange(0x61, 0x49);
 
 static SerialPacket startup(0x61, 0x01);
-static SerialDataPacket<unsigned long> baudRatePacket(0x61, 0x02);
 static SerialPacket shutdown(0x61, 0x03);
 
+// Time the host gets to open the serial before the first ping (ms)
+#ifndef CARDUINO_STARTUP_DELAY
+#define CARDUINO_STARTUP_DELAY 100
+#endif
+
+// Time between pings while waiting for the host (ms)
+#ifndef CARDUINO_PING_INTERVAL
+#define CARDUINO_PING_INTERVAL 100
+#endif
+
+// Time between the shutdown event and the shutdown frame (ms)
+#ifndef CARDUINO_SHUTDOWN_DELAY
+#define CARDUINO_SHUTDOWN_DELAY 500
+#endif
+
+// Room reported by availableForWrite() once the serial sent everything
+#ifndef CARDUINO_SERIAL_TX_EMPTY
+#ifdef SERIAL_TX_BUFFER_SIZE
+#define CARDUINO_SERIAL_TX_EMPTY (SERIAL_TX_BUFFER_SIZE - 1)
+#else
+#define CARDUINO_SERIAL_TX_EMPTY 63
+#endif
+#endif
+
+// EEPROM layout: type ID at 0-2, stored CAN subscriptions from here on
+#define CARDUINO_EEPROM_CAN_STORE 3
+// Last confirmed baud rate, right after the CAN subscriptions
+#define CARDUINO_EEPROM_BAUD_RATE (CARDUINO_EEPROM_CAN_STORE + CanStore::size())
+
+// Optional flags in the connection request
+#define CARDUINO_CONNECT_ESCAPING 0x01
+#define CARDUINO_CONNECT_AGGREGATE 0x02
+#define CARDUINO_CONNECT_DELTA 0x04
+#define CARDUINO_CONNECT_TIMESTAMPS 0x08
+#define CARDUINO_CONNECT_BAUD_RATE 0x10
+
+// Flags of the bulk subscription request
+#define CARDUINO_BULK_INTERVALS 0x01
+
+// Optional flags in the statistics request
+#define CARDUINO_STATISTICS_RESET 0x01
+
 class Carduino: public SerialListener {
 private:
     SerialReader * serialReader;
+    SerialQueue * serialQueue;
+    BaudRateNegotiation * baudRate;
     HardwareSerial * serial;
+    Stream * output;
     Can * can = NULL;
     PowerManager * powerManager = NULL;
     bool isConnectedFlag = false;
     uint32_t lastSerialEvent = 0;
-    void (*serialEvent)(uint8_t type, uint8_t id, BinaryBuffer *payloadBuffer) = NULL;
+    uint32_t startedAt = 0;
+    bool isStarted = false;
+    bool isEnding = false;
+    bool isShutdownSent = false;
+    uint32_t endingAt = 0;
+    void (*serialEvent)(uint8_t type, uint8_t id, SerialPayload *payloadBuffer) = NULL;
     void (*timeoutCallback)(void) = NULL;
 public:
     Carduino(HardwareSerial * serial,
-            void (*userEvent)(uint8_t type, uint8_t id, BinaryBuffer *payloadBuffer),
+            void (*userEvent)(uint8_t type, uint8_t id, SerialPayload *payloadBuffer),
             void (*timeoutCallback)(void)) {
-        this->serialReader = new SerialReader(128, serial);
+        this->serialReader = new SerialReader(serial);
+        this->serialQueue = new SerialQueue(serial);
+        this->baudRate = new BaudRateNegotiation(serial, this->serialQueue);
+        this->baudRate->setStore(CARDUINO_EEPROM_BAUD_RATE);
+        this->output = this->serialQueue->getStream(SerialQueue::CONTROL);
         this->serialEvent = userEvent;
         this->timeoutCallback = timeoutCallback;
         this->serial = serial;
@@ -60,128 +116,303 @@ public:
     }
     ~Carduino() {
         delete this->serialReader;
-        delete this->can;
+        delete this->serialQueue;
+        delete this->baudRate;
     }
+    /* Returns true while connected, does nothing between end() and begin() */
     bool update() {
+        if (!this->isStarted) {
+            return false;
+        }
+        this->serialQueue->update();
+
         if (this->serial->available()) {
             this->lastSerialEvent = millis();
             this->serialReader->read(this);
         }
+        this->baudRate->update();
 
         if (!this->isConnectedFlag) {
-            ping.serialize(this->serial, 500);
+            if ((uint32_t) (millis() - this->startedAt)
+                    >= CARDUINO_STARTUP_DELAY) {
+                ping.serialize(this->output, CARDUINO_PING_INTERVAL);
+            }
         } else {
             if (((uint32_t)millis() - this->lastSerialEvent) >= 1000) {
                 this->isConnectedFlag = false;
+                this->serialReader->setEscaping(false);
                 this->timeoutCallback();
             }
         }
         return this->isConnectedFlag;
     }
+    bool isConnected() {
+        return this->isConnectedFlag;
+    }
+    /* True if no byte from the host is waiting */
+    bool isIdle() {
+        return !this->isStarted || this->serial->available() == 0;
+    }
     void triggerEvent(uint8_t eventNum) {
         SerialPacket carduinoEvent(0x63, eventNum);
-        carduinoEvent.serialize(this->serial);
+        carduinoEvent.serialize(
+                this->serialQueue->getStream(SerialQueue::EVENT));
     }
     void addCan(Can * can) {
         this->can = can;
+        can->setSerialQueue(this->serialQueue);
+        can->setStore(CARDUINO_EEPROM_CAN_STORE);
+    }
+    /* Replies to a bulk request with the number of entries applied and sent */
+    void sendBulkReply(uint8_t id, uint8_t applied, uint8_t total) {
+        SerialFrame<7> frame(0x61, id);
+        frame.append(applied);
+        frame.append(total);
+        frame.send(this->output);
+    }
+    /* Sends every counter as 4 bytes, in the order of Statistics::Counter */
+    void sendStatistics(bool isReset) {
+        static_assert(Statistics::COUNTER_COUNT * 4 + 5 < SERIAL_QUEUE_SIZE,
+                "SERIAL_QUEUE_SIZE must hold the statistics reply");
+        uint32_t values[Statistics::COUNTER_COUNT];
+        statistics.snapshot(values, isReset);
+        SerialFrame<Statistics::COUNTER_COUNT * 4 + 5> frame(0x61, 0x0d);
+        for (uint8_t i = 0; i < Statistics::COUNTER_COUNT; i++) {
+            frame.appendLong(values[i]);
+        }
+        frame.send(this->output);
+    }
+    /* Sends the time of every startup phase as 2 bytes */
+    void sendStartupTimes() {
+        SerialFrame<StartupTimes::PHASE_COUNT * 2 + 5> frame(0x61, 0x0e);
+        for (uint8_t i = 0; i < StartupTimes::PHASE_COUNT; i++) {
+            frame.appendShort(startupTimes.get((StartupTimes::Phase) i));
+        }
+        frame.send(this->output);
     }
     void addPowerManager(PowerManager * powerManager) {
         this->powerManager = powerManager;
     }
+    /* Pings start after CARDUINO_STARTUP_DELAY, update() meanwhile */
     void begin() {
-        this->serial->begin(115200);
-        delay(1000);
+        this->baudRate->begin();
+        this->startedAt = millis();
+        this->isStarted = true;
     }
-    void end() {
-        this->triggerEvent(2);
-        this->serial->flush();
-        delay(500);
-        shutdown.serialize(this->serial);
-        this->serial->flush();
+    /*
+     * Says goodbye to the host and closes the serial without blocking, call
+     * it until it returns true. The host gets the shutdown event, then
+     * CARDUINO_SHUTDOWN_DELAY later the shutdown frame, and the serial is
+     * closed once both are sent. Without a host it closes right away.
+     */
+    bool end() {
+        if (!this->isStarted) {
+            return true;
+        }
+        if (!this->isEnding) {
+            if (!this->isConnectedFlag) {
+                this->disconnect();
+                this->serial->end();
+                return true;
+            }
+            this->triggerEvent(2);
+            this->isEnding = true;
+            this->isShutdownSent = false;
+            this->endingAt = millis();
+        }
+
+        this->serialQueue->update();
+        if (!this->serialQueue->isIdle()) {
+            return false;
+        }
+        if (!this->isShutdownSent) {
+            if ((uint32_t) (millis() - this->endingAt)
+                    < CARDUINO_SHUTDOWN_DELAY) {
+                return false;
+            }
+            shutdown.serialize(this->output);
+            this->isShutdownSent = true;
+            return false;
+        }
+        // Closing the serial would block until its buffer is sent
+        if (this->serial->availableForWrite() < CARDUINO_SERIAL_TX_EMPTY) {
+            return false;
+        }
+        this->disconnect();
         this->serial->end();
+        return true;
+    }
+    /*
+     * Stops like end() without waiting for the serial, for a host that is
+     * gone anyway. Pending frames are dropped, begin() starts over.
+     */
+    void disconnect() {
+        this->serialQueue->clear();
+        this->isEnding = false;
         this->isConnectedFlag = false;
+        this->serialReader->setEscaping(false);
+        this->isStarted = false;
     }
     virtual void onSerialPacket(uint8_t type, uint8_t id,
-            BinaryBuffer *payloadBuffer) {
+            SerialPayload *payloadBuffer) {
 
         switch (type) {
         case 0x61:
             switch (id) {
             case 0x00: { // Connection request
-                BinaryData::ByteResult majorVersionResult =
-                        payloadBuffer->readByte();
-                if (majorVersionResult.state == BinaryData::OK
-                        && majorVersionResult.data == ping.payload()->major) {
+                if (payloadBuffer->canRead(1)
+                        && payloadBuffer->readByte() == ping.payload()->major) {
+                    // Optional flags
+                    uint8_t flags = payloadBuffer->canRead(1) ?
+                            payloadBuffer->readByte() : 0;
+                    this->serialReader->setEscaping(
+                            flags & CARDUINO_CONNECT_ESCAPING);
+                    if (this->can) {
+                        this->can->setAggregating(
+                                flags & CARDUINO_CONNECT_AGGREGATE);
+                        this->can->setDelta(flags & CARDUINO_CONNECT_DELTA);
+                        this->can->setTimestamps(
+                                flags & CARDUINO_CONNECT_TIMESTAMPS);
+                        // The host starts without any values
+                        this->can->requestSnapshot();
+                    }
                     this->isConnectedFlag = true;
-                    startup.serialize(this->serial);
+                    startupTimes.mark(StartupTimes::CONNECTED);
+                    startup.serialize(this->output);
                     this->triggerEvent(1);
+
+                    // Try the last confirmed rate right away
+                    uint32_t storedRate = this->baudRate->getStoredRate();
+                    if ((flags & CARDUINO_CONNECT_BAUD_RATE) && storedRate > 0
+                            && storedRate != this->baudRate->getRate()) {
+                        this->baudRate->start(storedRate);
+                    }
                 }
                 break;
             }
-            case 0x0a: // start sniffer
+            case 0x0a: { // start sniffer with optional mode
+                uint8_t mode = payloadBuffer->canRead(1) ?
+                        payloadBuffer->readByte() : 0;
                 if (this->can) {
-                    this->can->startSniffer();
+                    this->can->startSniffer(mode);
                 }
                 break;
+            }
             case 0x0b: // stop sniffer
                 if (this->can) {
                     this->can->stopSniffer();
                 }
                 break;
+            case 0x0c: // send full values of all subscriptions
+                if (this->can) {
+                    this->can->refresh();
+                }
+                break;
+            case 0x0d: { // statistics with optional flags
+                bool isReset = payloadBuffer->canRead(1)
+                        && (payloadBuffer->readByte() & CARDUINO_STATISTICS_RESET);
+                this->sendStatistics(isReset);
+                break;
+            }
+            case 0x0e: // startup times
+                this->sendStartupTimes();
+                break;
+            case 0x0f: // send the cached value of all subscriptions
+                if (this->can) {
+                    this->can->requestSnapshot();
+                }
+                break;
+            case 0x10: { // coalesced changes of a CAN ID
+                if (!payloadBuffer->canRead(4)) {
+                    carDataReadError.serialize(this->output);
+                    break;
+                }
+                uint32_t canId = payloadBuffer->readLong();
+                SerialFrame<10> frame(0x61, 0x10);
+                frame.appendLong(canId);
+                frame.append(this->can ?
+                        this->can->getCoalescedCount(canId) : 0);
+                frame.send(this->output);
+                break;
+            }
             case 0x49: {
-                BinaryData::ByteResult type1 = payloadBuffer->readByte();
-                BinaryData::ByteResult type2 = payloadBuffer->readByte();
-                BinaryData::ByteResult type3 = payloadBuffer->readByte();
-                if (type1.state == BinaryData::OK
-                        && type2.state == BinaryData::OK
-                        && type3.state == BinaryData::OK) {
-                    EEPROM.update(0, type1.data);
-                    EEPROM.update(1, type2.data);
-                    EEPROM.update(2, type3.data);
-
-                    ping.payload()->type1 = type1.data;
-                    ping.payload()->type2 = type2.data;
-                    ping.payload()->type3 = type3.data;
-
-                    idChange.payload()->type1 = type1.data;
-                    idChange.payload()->type2 = type2.data;
-                    idChange.payload()->type3 = type3.data;
-                    idChange.serialize(this->serial, 0);
+                if (payloadBuffer->canRead(3)) {
+                    uint8_t type1 = payloadBuffer->readByte();
+                    uint8_t type2 = payloadBuffer->readByte();
+                    uint8_t type3 = payloadBuffer->readByte();
+                    EEPROM.update(0, type1);
+                    EEPROM.update(1, type2);
+                    EEPROM.update(2, type3);
+
+                    ping.payload()->type1 = type1;
+                    ping.payload()->type2 = type2;
+                    ping.payload()->type3 = type3;
+
+                    idChange.payload()->type1 = type1;
+                    idChange.payload()->type2 = type2;
+                    idChange.payload()->type3 = type3;
+                    idChange.serialize(this->output, 0);
                 } else {
-                    idChangeError.serialize(this->serial, 0);
+                    idChangeError.serialize(this->output, 0);
                 }
                 break;
             }
             case 0x63: {
-                BinaryData::LongResult canIdResult = payloadBuffer->readLong();
-                BinaryData::ByteResult maskResult = payloadBuffer->readByte();
-                if (canIdResult.state == BinaryData::OK
-                        && maskResult.state == BinaryData::OK) {
-                    if (this->can) {
-                        if (!this->can->addCanPacket(canIdResult.data,
-                                maskResult.data)) {
-                            carDataFullError.serialize(this->serial);
-                            ;
-                        }
+                if (payloadBuffer->canRead(5)) {
+                    uint32_t canId = payloadBuffer->readLong();
+                    uint8_t mask = payloadBuffer->readByte();
+                    // Optional minimum interval between updates in ms
+                    uint16_t interval = payloadBuffer->canRead(2) ?
+                            payloadBuffer->readShort() : 0;
+                    if (this->can
+                            && !this->can->addCanPacket(canId, mask, interval)) {
+                        carDataFullError.serialize(this->output);
                     }
                 } else {
-                    carDataReadError.serialize(this->serial);
+                    carDataReadError.serialize(this->output);
                 }
                 break;
             }
-            case 0x72: { // set baud rate
-                BinaryData::LongResult result = payloadBuffer->readLong();
-                if (result.state == BinaryData::OK) {
-                    baudRatePacket.payload(htonl(result.data));
-                    baudRatePacket.serialize(&Serial);
-                    this->serial->flush();
-                    this->serial->end();
-                    this->serial->begin(result.data);
-                } else {
-                    baudRateReadError.serialize(this->serial);
+            case 0x64: { // subscribe to a list of CAN IDs
+                bool hasFlags = payloadBuffer->canRead(1);
+                bool hasIntervals = hasFlags
+                        && (payloadBuffer->readByte() & CARDUINO_BULK_INTERVALS);
+                uint8_t entrySize = hasIntervals ? 7 : 5;
+                uint8_t total = payloadBuffer->available() / entrySize;
+                uint8_t accepted = 0;
+                if (hasFlags && this->can
+                        && payloadBuffer->available() % entrySize == 0) {
+                    accepted = this->can->addCanPackets(payloadBuffer, total,
+                            hasIntervals);
+                }
+                this->sendBulkReply(id, accepted, total);
+                break;
+            }
+            case 0x65: { // unsubscribe from a list of CAN IDs
+                uint8_t total = payloadBuffer->available() / 4;
+                uint8_t removed = 0;
+                if (this->can) {
+                    removed = this->can->removeCanPackets(payloadBuffer);
                 }
+                this->sendBulkReply(id, removed, total);
                 break;
             }
+            case 0x66: // unsubscribe from everything
+                if (this->can) {
+                    this->can->clearCanPackets();
+                }
+                this->sendBulkReply(id, 0, 0);
+                break;
+            case 0x72: { // probe a new baud rate
+                if (!payloadBuffer->canRead(4)
+                        || !this->baudRate->start(payloadBuffer->readLong())) {
+                    baudRateReadError.serialize(this->output);
+                }
+                break;
+            }
+            case 0x73: // echo of the baud rate test pattern
+                this->baudRate->onEcho(payloadBuffer);
+                break;
             }
             break;
         default:
@@ -1,22 +1,45 @@
+// Room for the decoded signals below, each takes 5 bytes of RAM
+#define CAN_MAX_SIGNALS 2
+
 #include "Arduino.h"
 #include "timer.h"
 #include "network.h"
 #include "carsystems.h"
 #include "power.h"
 #include "carduino.h"
+#include "scheduler.h"
 #include "370z.h"
-#include <everytime.h>
 
 #define UNUSED(x) (void)(x)
 #define ONE_SECOND 1000UL
 #define ONE_MINUTE ONE_SECOND * 60
 
-void onCarduinoSerialTimeout();
-void onCarduinoSerialEvent(uint8_t type, uint8_t id, BinaryBuffer *payloadBuffer);
+// Define to let the MCP2515 wake up the Arduino, its interrupt pin goes to pin 2
+//#define WAKE_ON_CAN
+#define WAKE_CAN_ID 0x60D
 
+void onCarduinoSerialTimeout();
+void onPowerCycled();
+void checkSteeringControl();
+bool isIdle();
+void onCarduinoSerialEvent(uint8_t type, uint8_t id, SerialPayload *payloadBuffer);
+
+#ifdef WAKE_ON_CAN
+Can can(&Serial, 2, 6);
+#else
 Can can(&Serial, 5, 6);
+#endif
 PowerManager powerManager(&Serial, 3, 4);
 Carduino carduino(&Serial, onCarduinoSerialEvent, onCarduinoSerialTimeout);
+Scheduler scheduler;
+
+// Sent to the host as 0x62 0x10 whenever they change
+static const CanSignal signals[CAN_MAX_SIGNALS] = {
+    // Accessory power, byte 1 bit 1
+    CanSignalLayout<14, 1>::signal(WAKE_CAN_ID),
+    // Front left door opened, byte 0 bit 3
+    CanSignalLayout<4, 1>::signal(WAKE_CAN_ID)
+};
 
 //NissanClimateControl nissanClimateControl;
 NissanSteeringControl nissanSteeringControl(A0, A1);
@@ -33,44 +56,73 @@ void setup() {
     powerManager.setup();
     carduino.addCan(&can);
     carduino.addPowerManager(&powerManager);
-    can.setup(MCP_ANY, CAN_500KBPS, MCP_8MHZ);
+    can.setup(MCP_STDEXT, CAN_500KBPS, MCP_8MHZ);
+    can.setSignals(signals, CAN_MAX_SIGNALS);
+#ifdef WAKE_ON_CAN
+    powerManager.setCanWakeUp(&can, WAKE_CAN_ID);
+#endif
+
+    scheduler.every(10, checkSteeringControl);
+    //scheduler.every(250, broadcastClimateControl);
 }
 
 void loop() {
+#ifdef WAKE_ON_CAN
+    powerManager.update<2, LOW, ONE_SECOND / 2, ONE_MINUTE * 15>(onSleep,
+            onWakeUp, onLoop, onShutdown);
+#else
     powerManager.update<2, RISING, ONE_SECOND / 2, ONE_MINUTE * 15>(onSleep,
-            onWakeUp, onLoop);
+            onWakeUp, onLoop, onShutdown);
+#endif
 }
 
-void onCarduinoSerialEvent(uint8_t type, uint8_t id, BinaryBuffer *payloadBuffer) {
+void onCarduinoSerialEvent(uint8_t type, uint8_t id, SerialPayload *payloadBuffer) {
     UNUSED(id);
     can.forwardFromSerial(type, payloadBuffer);
     //nissanClimateControl.push(eventId, payloadBuffer);
 }
 
 void onCarduinoSerialTimeout() {
-    carduino.end();
+    // The host is gone, so nothing is worth blocking the loop for
+    carduino.disconnect();
     powerManager.togglePeripherals(false);
     powerManager.toggleCharger(false);
-    delay(1000);
+    // Power everything up again in a second, without stopping the loop
+    scheduler.after(ONE_SECOND, onPowerCycled);
+}
+
+void onPowerCycled() {
     powerManager.toggleCharger(true);
     powerManager.togglePeripherals(true);
     carduino.begin();
 }
 
+void checkSteeringControl() {
+    if (carduino.isConnected()) {
+        nissanSteeringControl.check(&carduino);
+    }
+}
+
 void onLoop() {
-    if (carduino.update()) {
+    // A wake up by CAN is only confirmed by a processed frame of the wake ID
+    if (carduino.update() || powerManager.isWaking()) {
         can.updateFromCan(onCan);
+    }
+    scheduler.update();
 
-        nissanSteeringControl.check(&carduino);
-
-        /*
-        every(250) {
-            nissanClimateControl.broadcast(can);
-        }
-        */
+    // Halt until the next CAN frame, serial byte or timer tick
+    if (powerManager.idle(isIdle)) {
+        scheduler.restartLatency();
     }
 }
 
+bool isIdle() {
+    // Frames are only processed while connected or waking up
+    bool isProcessingCan = carduino.isConnected() || powerManager.isWaking();
+    return (!isProcessingCan || can.isIdle()) && carduino.isIdle()
+            && scheduler.isIdle();
+}
+
 bool onSleep() {
     // Check sleep conditions
     if (isAccessoryOn) {
@@ -82,25 +134,31 @@ bool onSleep() {
         shouldSleep = shouldSleep || sleepTimer.check(ONE_MINUTE * 30);
     }
 
-    if (shouldSleep) {
-        carduino.end();
-    }
-
     return shouldSleep;
 }
 
+bool onShutdown() {
+    // Runs again with the next update until the host got its goodbye
+    if (!carduino.end()) {
+        return false;
+    }
+    can.end();
+    return true;
+}
+
 void onWakeUp() {
     // Reset driver door status, otherwise sleep is triggered after wake up
     shouldSleep = false;
     sleepTimer.reset();
+    scheduler.resetLatency();
     carduino.begin();
-    can.setup(MCP_ANY, CAN_500KBPS, MCP_8MHZ);
+    can.setup(MCP_STDEXT, CAN_500KBPS, MCP_8MHZ);
 }
 
 void onCan(uint32_t canId, uint8_t data[], uint8_t len) {
     UNUSED(len);
 
-    if (canId == 0x60D) {
+    if (canId == WAKE_CAN_ID) {
         isAccessoryOn = Can::readFlag<1, B00000010>(data);
         bool isFrontLeftOpen = Can::readFlag<0, B00001000>(data);
         if (!isAccessoryOn && isFrontLeftOpen && !isDriverDoorOpened) {
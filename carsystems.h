@@ -1,66 +1,329 @@
 #ifndef CARSYSTEMS_H_
 #define CARSYSTEMS_H_
 
+#include <string.h>
+#include "Arduino.h"
 #include "network.h"
+#include "serialpacket.h"
 
+// 22 bytes of RAM each, see the RAM budget in the README. The 2 KB of the
+// ATmega328P only leave room for 20, boards with more RAM keep 50.
+#ifndef CAN_MAX_CAR_DATA
+#if defined(RAMEND) && RAMEND > 0x8FF
+#define CAN_MAX_CAR_DATA 50
+#else
+#define CAN_MAX_CAR_DATA 20
+#endif
+#endif
+
+// Capture times are kept in ticks of 64 us, wrapping after about 4 s
+#define CAN_TIMESTAMP_SHIFT 6
+
+/************************************************************************
+ * Latest value of the masked bytes of a CAN ID, and which of them changed
+ * since the last update was sent.
+ */
 class CarData {
 private:
-    uint32_t canId;
-    uint8_t * data;
-    uint8_t mask;
-    uint8_t length = 0;
-public:
-    CarData(uint32_t canId, uint8_t mask) {
-        this->mask = mask;
-        this->canId = canId;
+    uint32_t canId = 0;
+    uint8_t mask = 0;
+    uint8_t changed = 0;
+    uint64_t data = 0;
+    bool isValueKnown = false;
+
+    /*
+     * Expands a byte mask (bit 7 selects byte 0 of the frame) to a lane
+     * mask with 0xFF in every selected byte of the frame.
+     */
+    static uint64_t laneMask(uint8_t mask) {
+        union {
+            uint64_t lanes;
+            uint8_t bytes[8];
+        } result;
+        for (uint8_t i = 0; i < 8; i++) {
+            result.bytes[i] = (mask & (0x80 >> i)) ? 0xFF : 0x00;
+        }
+        return result.lanes;
+    }
+
+    static uint8_t countBytes(uint8_t mask) {
+        uint8_t length = 0;
+        for (uint8_t bits = mask; bits; bits &= bits - 1) {
+            length++;
+        }
+        return length;
+    }
+
+    template<uint8_t CAPACITY>
+    void appendBytes(SerialFrame<CAPACITY> * frame, uint8_t mask) {
+        const uint8_t * bytes = (const uint8_t *) &this->data;
         for (uint8_t i = 0; i < 8; i++) {
-            if (mask & 1 << i) {
-                this->length++;
+            if (mask & (0x80 >> i)) {
+                frame->append(bytes[i]);
             }
         }
-        this->data = (uint8_t*) calloc(sizeof(char), this->length);
     }
-    ~CarData() {
-        free(this->data);
+public:
+    CarData() {
+    }
+    CarData(uint32_t canId, uint8_t mask) {
+        this->canId = canId;
+        this->mask = mask;
     }
     uint32_t getCanId() {
         return this->canId;
     }
+    uint8_t getMask() {
+        return this->mask;
+    }
     void setMask(uint8_t mask) {
         this->mask = mask;
+        this->changed &= mask;
+        this->data &= laneMask(mask);
     }
-    boolean serialize(uint32_t canId, uint8_t canData[8], Stream * serial) {
-        if (this->canId != canId) {
+    /* True once a frame of the CAN ID was received */
+    bool hasValue() {
+        return this->isValueKnown;
+    }
+    /* Pending data changed but was not sent yet */
+    bool isPending() {
+        return this->changed != 0;
+    }
+    /* Clears the changed bytes once they are sent */
+    void markSent() {
+        this->changed = 0;
+    }
+    /* Sends every masked byte with the next update, once there is a value */
+    void requestRefresh() {
+        if (this->isValueKnown) {
+            this->changed = this->mask;
+        }
+    }
+    uint8_t getLength() {
+        return countBytes(this->mask);
+    }
+    /* Delta updates carry an 11 bit CAN ID in two bytes */
+    bool isDeltaCapable() {
+        return this->canId <= 0x07FF;
+    }
+    /* Length of the delta entry: CAN ID, changed bitmap and changed bytes */
+    uint8_t getDeltaLength() {
+        return 3 + countBytes(this->changed);
+    }
+    /*
+     * Stores the masked bytes of the frame and remembers which of them
+     * changed since the last update was sent, all of them for the first
+     * frame. Returns true if any changed.
+     */
+    boolean update(uint8_t canData[8]) {
+        uint64_t frame;
+        memcpy(&frame, canData, sizeof(frame));
+        frame &= laneMask(this->mask);
+        if (!this->isValueKnown) {
+            // The host knows none of the bytes yet, zeros included
+            this->isValueKnown = true;
+            this->changed = this->mask;
+            this->data = frame;
+            return true;
+        }
+        if (frame == this->data) {
             return false;
         }
 
-        bool dataChanged = false;
-        uint8_t index = 0;
+        const uint8_t * newBytes = (const uint8_t *) &frame;
+        const uint8_t * oldBytes = (const uint8_t *) &this->data;
         for (uint8_t i = 0; i < 8; i++) {
-            if (mask & 1 << (7 - i)) {
-                uint8_t dataByte = canData[i];
-                if (this->data[index] != dataByte) {
-                    this->data[index] = dataByte;
-                    dataChanged = true;
-                }
-                index++;
+            if (newBytes[i] != oldBytes[i]) {
+                this->changed |= 0x80 >> i;
             }
         }
+        this->data = frame;
+        return true;
+    }
+    /* Appends the CAN ID followed by the masked bytes */
+    template<uint8_t CAPACITY>
+    bool appendTo(SerialFrame<CAPACITY> * frame) {
+        if (frame->available() < 4 + this->getLength()) {
+            return false;
+        }
+        frame->appendLong(this->canId);
+        this->appendBytes(frame, this->mask);
+        return true;
+    }
+    /* Appends the CAN ID, the changed bitmap and the changed bytes */
+    template<uint8_t CAPACITY>
+    bool appendDeltaTo(SerialFrame<CAPACITY> * frame) {
+        if (frame->available() < this->getDeltaLength()) {
+            return false;
+        }
+        frame->appendShort(this->canId);
+        frame->append(this->changed);
+        this->appendBytes(frame, this->changed);
+        return true;
+    }
+    void serialize(Stream * serial) {
+        SerialFrame<17> frame(0x62, 0x01);
+        this->appendTo(&frame);
+        frame.send(serial);
+    }
+    void serializeDelta(Stream * serial) {
+        SerialFrame<16> frame(0x62, 0x03);
+        this->appendDeltaTo(&frame);
+        frame.send(serial);
+    }
+    boolean serialize(uint32_t canId, uint8_t canData[8], Stream * serial) {
+        if (this->canId != canId || !this->update(canData)) {
+            return false;
+        }
+        this->serialize(serial);
+        this->markSent();
+        return true;
+    }
+};
+
+/************************************************************************
+ * When a CarData may be sent next, and when and how often it changed.
+ * Only touched on changes, so it is kept apart from the CarData every
+ * received frame is compared with.
+ */
+class CarDataTiming {
+private:
+    uint16_t interval = 0;
+    uint16_t lastSent = 0;
+    uint16_t captured = 0;
+    uint8_t coalesced = 0;
+public:
+    CarDataTiming() {
+    }
+    CarDataTiming(uint16_t interval) {
+        this->interval = interval;
+        // Allow the first update right away
+        this->lastSent = (uint16_t) millis() - interval;
+    }
+    uint16_t getInterval() {
+        return this->interval;
+    }
+    /* True if the minimum interval since the last update has passed */
+    bool isDue(uint16_t now) {
+        return (uint16_t) (now - this->lastSent) >= this->interval;
+    }
+    void markSent(uint16_t now) {
+        this->lastSent = now;
+    }
+    /* Changes replaced by a newer value before they were sent, up to 255 */
+    uint8_t getCoalescedCount() {
+        return this->coalesced;
+    }
+    /* Ticks of 64 us since the latest change was captured */
+    uint16_t getAge(uint32_t now) {
+        return (uint16_t) (now >> CAN_TIMESTAMP_SHIFT) - this->captured;
+    }
+    /* The timestamp is the capture time of the change in micros */
+    void capture(uint32_t timestamp, bool isCoalesced) {
+        if (isCoalesced && this->coalesced < 0xFF) {
+            this->coalesced++;
+        }
+        this->captured = timestamp >> CAN_TIMESTAMP_SHIFT;
+    }
+};
+
+/************************************************************************
+ * Fixed size table of CarData, kept sorted by CAN ID.
+ *
+ * Lookups are a binary search, inserting and removing shifts the entries
+ * in place. The timing of each entry lives at the same index of a second
+ * array, so the search only walks the 15 byte CarData. Nothing is
+ * allocated on the heap.
+ */
+class CarDataTable {
+private:
+    CarData entries[CAN_MAX_CAR_DATA];
+    CarDataTiming timings[CAN_MAX_CAR_DATA];
+    uint8_t count = 0;
 
-        if (dataChanged) {
-            uint32_t flippedCanId = htonl(this->canId);
-            serial->write("{");
-            serial->write(0x62);
-            serial->write(0x01);
-            serial->write(this->length + 0x04);
-            serial->write((byte*)&flippedCanId, sizeof(this->canId));
-            for (uint8_t i = 0; i < this->length; i++) {
-                serial->write(this->data[i]);
+    /* Index of the first entry with a CAN ID not less than canId */
+    uint8_t lowerBound(uint32_t canId) {
+        uint8_t low = 0;
+        uint8_t high = this->count;
+        while (low < high) {
+            uint8_t middle = (low + high) / 2;
+            if (this->entries[middle].getCanId() < canId) {
+                low = middle + 1;
+            } else {
+                high = middle;
             }
-            serial->write("}");
+        }
+        return low;
+    }
+public:
+    CarData * find(uint32_t canId) {
+        uint8_t index = this->lowerBound(canId);
+        if (index < this->count && this->entries[index].getCanId() == canId) {
+            return &this->entries[index];
+        }
+        return NULL;
+    }
+    bool add(uint32_t canId, uint8_t mask, uint16_t interval = 0) {
+        uint8_t index = this->lowerBound(canId);
+        if (index >= this->count || this->entries[index].getCanId() != canId) {
+            if (this->count >= CAN_MAX_CAR_DATA) {
+                return false;
+            }
+            memmove(&this->entries[index + 1], &this->entries[index],
+                    (this->count - index) * sizeof(CarData));
+            memmove(&this->timings[index + 1], &this->timings[index],
+                    (this->count - index) * sizeof(CarDataTiming));
+            this->count++;
+        }
+        this->entries[index] = CarData(canId, mask);
+        this->timings[index] = CarDataTiming(interval);
+        return true;
+    }
+    bool remove(uint32_t canId) {
+        uint8_t index = this->lowerBound(canId);
+        if (index >= this->count || this->entries[index].getCanId() != canId) {
+            return false;
         }
 
-        return dataChanged;
+        this->count--;
+        memmove(&this->entries[index], &this->entries[index + 1],
+                (this->count - index) * sizeof(CarData));
+        memmove(&this->timings[index], &this->timings[index + 1],
+                (this->count - index) * sizeof(CarDataTiming));
+        return true;
+    }
+    void clear() {
+        this->count = 0;
+    }
+    void requestRefresh() {
+        for (uint8_t i = 0; i < this->count; i++) {
+            this->entries[i].requestRefresh();
+        }
+    }
+    uint8_t size() {
+        return this->count;
+    }
+    CarData * get(uint8_t index) {
+        return &this->entries[index];
+    }
+    CarDataTiming * getTiming(uint8_t index) {
+        return &this->timings[index];
+    }
+    /* Timing of an entry returned by find() or get() */
+    CarDataTiming * getTiming(CarData * data) {
+        return &this->timings[data - this->entries];
+    }
+    /*
+     * Updates the entry with a received frame and records the capture
+     * time of a change. Returns true if any masked byte changed.
+     */
+    bool update(CarData * data, uint8_t canData[8], uint32_t timestamp) {
+        bool isPending = data->isPending();
+        if (!data->update(canData)) {
+            return false;
+        }
+        this->getTiming(data)->capture(timestamp, isPending);
+        return true;
     }
 };
 
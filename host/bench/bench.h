@@ -0,0 +1,76 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+// Standard headers first, the core's min and max macros break them
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "hostmock.h"
+#include "Arduino.h"
+
+/************************************************************************
+ * Wall clock timing for the host benchmarks.
+ *
+ * Reports the throughput in frames per second and the serial bytes per
+ * frame. The simulated Arduino clock is independent of the wall clock.
+ */
+class Benchmark {
+private:
+    const char * name;
+    std::chrono::steady_clock::time_point startedAt;
+public:
+    Benchmark(const char * name) {
+        this->name = name;
+        this->startedAt = std::chrono::steady_clock::now();
+    }
+    void report(unsigned long frames, unsigned long bytes) {
+        double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - this->startedAt).count();
+        printf("%s: %lu frames in %.3f s, %.0f frames/s, %.2f bytes/frame\n",
+                this->name, frames, seconds,
+                seconds > 0 ? frames / seconds : 0,
+                frames > 0 ? (double) bytes / frames : 0);
+    }
+
+    /* Number of iterations from the command line */
+    static unsigned long iterations(int argc, char ** argv,
+            unsigned long defaultCount) {
+        return argc > 1 ? strtoul(argv[1], NULL, 10) : defaultCount;
+    }
+};
+
+/*
+ * Stream that counts what is written to it. The bytes are summed up, so the
+ * compiler cannot drop the work of assembling them.
+ */
+class CountingStream: public Stream {
+public:
+    unsigned long count = 0;
+    uint8_t sum = 0;
+    virtual size_t write(uint8_t value) {
+        this->sum += value;
+        this->count++;
+        return 1;
+    }
+    virtual size_t write(const uint8_t * buffer, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            this->sum += buffer[i];
+        }
+        this->count += size;
+        return size;
+    }
+    virtual int availableForWrite() {
+        return 63;
+    }
+    virtual int available() {
+        return 0;
+    }
+    virtual int read() {
+        return -1;
+    }
+    virtual int peek() {
+        return -1;
+    }
+};
+
+#endif /* BENCH_H_ */
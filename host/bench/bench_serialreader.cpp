@@ -0,0 +1,48 @@
+/*
+ * SerialReader::read on a stream of host requests, fed in chunks the size
+ * of the receive buffer of the Arduino serial.
+ */
+#include "bench.h"
+#include "serial.h"
+
+class CountingListener: public SerialListener {
+public:
+    unsigned long count = 0;
+    virtual void onSerialPacket(uint8_t type, uint8_t id,
+            SerialPayload * payloadBuffer) {
+        (void) type;
+        (void) id;
+        (void) payloadBuffer;
+        this->count++;
+    }
+};
+
+int main(int argc, char ** argv) {
+    unsigned long iterations = Benchmark::iterations(argc, argv, 1000000);
+    HostMock::reset();
+
+    // A subscription, a request without payload and a user event
+    static const uint8_t frames[] = {
+        0x7b, 0x61, 0x63, 0x07, 0x00, 0x00, 0x06, 0x0d, 0xff, 0x00, 0x32, 0x7d,
+        0x7b, 0x61, 0x0c, 0x7d,
+        0x7b, 0x70, 0x01, 0x04, 0x01, 0x02, 0x03, 0x04, 0x7d
+    };
+    const unsigned long framesPerPass = 3;
+
+    SerialReader reader(&Serial);
+    CountingListener listener;
+    unsigned long bytes = 0;
+
+    Benchmark benchmark("SerialReader::read");
+    for (unsigned long i = 0; i < iterations; i += framesPerPass) {
+        HostMock::receiveSerial(frames, sizeof(frames));
+        bytes += sizeof(frames);
+        if (HostMock::serialInput.size() >= 64) {
+            reader.read(&listener);
+        }
+    }
+    reader.read(&listener);
+    benchmark.report(listener.count, bytes);
+
+    return listener.count * sizeof(frames) == bytes * framesPerPass ? 0 : 1;
+}
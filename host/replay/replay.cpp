@@ -0,0 +1,223 @@
+/*
+ * Replays a candump log (candump -l) through CanReplay into
+ * Can::updateFromCan and records the serial output.
+ *
+ *   carduino_replay [options] trace.log
+ *
+ *   -i ID[:MASK[:INTERVAL]]  subscribe to a CAN ID (hex), without any
+ *                            subscription every frame is sniffed
+ *   -a -d -t                 aggregate, delta and time stamped output
+ *   -s SPEED                 1 (default) replays in original time, 10 ten
+ *                            times as fast, 0 as fast as the loop takes it
+ *   -l MICROS                time between two passes of the loop (1000)
+ *   -r FILE                  writes the serial output to FILE
+ *   -c FILE                  compares the serial output with FILE
+ *
+ * Time is simulated, the replay runs as fast as the host does. The speed
+ * compresses the simulated time of the trace, so a faster replay sees the
+ * frames closer together, like a busier bus would. Exits with 1 if the
+ * output differs from the compared file.
+ */
+// Standard headers first, the core's min and max macros break them
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+#include "hostmock.h"
+#include "Arduino.h"
+#include "can.h"
+#include "canreplay.h"
+
+// millis() is 0 at power up, which some rate limits treat as never sent
+#define REPLAY_START_TIME 1000000ULL
+
+static void onCan(uint32_t canId, uint8_t data[], uint8_t length) {
+    (void) canId;
+    (void) data;
+    (void) length;
+}
+
+/* Reads the trace file as the input Stream of the CanReplay */
+class TraceStream: public Stream {
+private:
+    FILE * file;
+public:
+    TraceStream(FILE * file) {
+        this->file = file;
+    }
+    virtual int available() {
+        return this->peek() < 0 ? 0 : 1;
+    }
+    virtual int read() {
+        return fgetc(this->file);
+    }
+    virtual int peek() {
+        int c = fgetc(this->file);
+        if (c >= 0) {
+            ungetc(c, this->file);
+        }
+        return c;
+    }
+    virtual size_t write(uint8_t value) {
+        (void) value;
+        return 0;
+    }
+    using Print::write;
+};
+
+static bool subscribe(Can * can, const char * text) {
+    char * end;
+    uint32_t canId = strtoul(text, &end, 16);
+    uint8_t mask = 0xFF;
+    uint16_t interval = 0;
+    if (*end == ':') {
+        mask = strtoul(end + 1, &end, 16);
+    }
+    if (*end == ':') {
+        interval = strtoul(end + 1, &end, 10);
+    }
+    return *end == '\0' && can->addCanPacket(canId, mask, interval);
+}
+
+static bool readFile(const char * path, std::vector<uint8_t> * content) {
+    FILE * file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    uint8_t buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        content->insert(content->end(), buffer, buffer + length);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool writeFile(const char * path, const std::vector<uint8_t> & content) {
+    FILE * file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    bool isWritten = fwrite(content.data(), 1, content.size(), file)
+            == content.size();
+    return fclose(file) == 0 && isWritten;
+}
+
+int main(int argc, char ** argv) {
+    HostMock::reset();
+    SerialQueue queue(&Serial);
+    Can can(&Serial, HostMock::canInterruptPin, 10);
+    can.setSerialQueue(&queue);
+    can.setup(MCP_STD, CAN_500KBPS, MCP_8MHZ);
+
+    unsigned long speed = 1;
+    unsigned long loopTime = 1000;
+    const char * recordPath = NULL;
+    const char * comparePath = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "i:adts:l:r:c:")) != -1) {
+        switch (option) {
+        case 'i':
+            if (!subscribe(&can, optarg)) {
+                fprintf(stderr, "Invalid subscription %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'a':
+            can.setAggregating(true);
+            break;
+        case 'd':
+            can.setDelta(true);
+            break;
+        case 't':
+            can.setTimestamps(true);
+            break;
+        case 's':
+            speed = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            loopTime = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            recordPath = optarg;
+            break;
+        case 'c':
+            comparePath = optarg;
+            break;
+        default:
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || loopTime < 1 || speed > 255) {
+        fprintf(stderr, "Usage: %s [-i ID[:MASK[:INTERVAL]]] [-a] [-d] [-t] "
+                "[-s SPEED] [-l MICROS] [-r FILE] [-c FILE] trace.log\n",
+                argv[0]);
+        return 2;
+    }
+    FILE * trace = fopen(argv[optind], "r");
+    if (!trace) {
+        fprintf(stderr, "Cannot open %s\n", argv[optind]);
+        return 2;
+    }
+
+    std::vector<uint8_t> output;
+    TraceStream input(trace);
+    CanReplay replay(&input, &can);
+    replay.setSpeed(speed);
+    HostMock::now = REPLAY_START_TIME;
+    auto wallStart = std::chrono::steady_clock::now();
+
+    // Passes of the loop until the whole trace is injected
+    bool isReplaying = true;
+    while (isReplaying) {
+        isReplaying = replay.update();
+        can.updateFromCan(onCan);
+        output.insert(output.end(), HostMock::serialOutput.begin(),
+                HostMock::serialOutput.end());
+        HostMock::serialOutput.clear();
+        HostMock::now += loopTime;
+    }
+    fclose(trace);
+
+    // A second of loop passes sends whatever is still pending
+    for (uint64_t end = HostMock::now + 1000000ULL; HostMock::now < end;
+            HostMock::now += loopTime) {
+        can.updateFromCan(onCan);
+    }
+    output.insert(output.end(), HostMock::serialOutput.begin(),
+            HostMock::serialOutput.end());
+    HostMock::serialOutput.clear();
+
+    unsigned long frames = replay.getReplayedCount();
+    double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - wallStart).count();
+    printf("Replayed %lu frames in %.3f s, %.0f frames/s, %zu serial bytes, "
+            "%lu dropped\n", frames, seconds,
+            seconds > 0 ? frames / seconds : 0, output.size(),
+            (unsigned long) can.getDroppedFrameCount());
+
+    if (recordPath && !writeFile(recordPath, output)) {
+        fprintf(stderr, "Cannot write %s\n", recordPath);
+        return 2;
+    }
+    if (comparePath) {
+        std::vector<uint8_t> expected;
+        if (!readFile(comparePath, &expected)) {
+            fprintf(stderr, "Cannot open %s\n", comparePath);
+            return 2;
+        }
+        size_t offset = 0;
+        while (offset < output.size() && offset < expected.size()
+                && output[offset] == expected[offset]) {
+            offset++;
+        }
+        if (offset < output.size() || offset < expected.size()) {
+            printf("Output differs from %s at byte %zu of %zu (expected %zu)\n",
+                    comparePath, offset, output.size(), expected.size());
+            return 1;
+        }
+        printf("Output matches %s\n", comparePath);
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * Runs carduino.ino on the host for a simulated second with a host
+ * connected and a CAN frame every 10 ms. Between the frames the CPU has
+ * nothing to do, so it has to idle, which it only can if the MCP2515 wakes
+ * it up on the shipped wiring. Then the host goes silent, and the loop must
+ * not block while the connection times out. The Arduino IDE generates the
+ * prototypes of the sketch, so they are declared here.
+ */
+#include <stdio.h>
+#include "hostmock.h"
+#include "Arduino.h"
+
+bool onSleep();
+void onWakeUp();
+void onLoop();
+bool onShutdown();
+void onCan(uint32_t canId, uint8_t data[], uint8_t len);
+
+#include "carduino.ino"
+
+// Connection request for version 1 without flags, also keeps it alive
+static const uint8_t connectFrame[] = { 0x7b, 0x61, 0x00, 0x01, 0x01, 0x7d };
+
+int main() {
+    HostMock::reset();
+    setup();
+    const uint8_t data[8] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+    const unsigned long passes = 10000;
+    unsigned long connectedPasses = 0;
+    uint64_t longestPass = 0;
+    // Connected for the first second, silent for the next two
+    for (unsigned long i = 0; i < 3 * passes; i++) {
+        HostMock::advanceMicros(100);
+        if (i < passes && i % 5000 == 0) {
+            HostMock::receiveSerial(connectFrame, sizeof(connectFrame));
+        }
+        if (i % 100 == 0) {
+            HostMock::receiveCan(0x60D, 8, data);
+        }
+        uint64_t passStart = HostMock::now;
+        loop();
+        if (HostMock::now - passStart > longestPass) {
+            longestPass = HostMock::now - passStart;
+        }
+        if (i < passes && carduino.isConnected()) {
+            connectedPasses++;
+        }
+        if (i == passes - 1) {
+            printf("Idled in %u of %lu loop passes, %lu connected\n",
+                    (unsigned) HostMock::sleepCount, passes, connectedPasses);
+        }
+    }
+    printf("Longest loop pass %u us, %u serial flushes, %s\n",
+            (unsigned) longestPass, (unsigned) HostMock::serialFlushCount,
+            carduino.isConnected() ? "still connected" : "timed out");
+    bool isIdling = connectedPasses > passes / 2
+            && HostMock::sleepCount > passes / 2;
+    bool isNonBlocking = longestPass < 1000
+            && HostMock::serialFlushCount == 0 && !carduino.isConnected();
+    return isIdling && isNonBlocking ? 0 : 1;
+}
@@ -0,0 +1,40 @@
+#ifndef ANALOGMULTIBUTTON_H_
+#define ANALOGMULTIBUTTON_H_
+
+/* Host stand-in for the AnalogMultiButton library, no button is pressed */
+
+#include "Arduino.h"
+
+class AnalogMultiButton {
+public:
+    AnalogMultiButton(int pin, int total, const int values[],
+            unsigned int debounceDuration = 20,
+            unsigned int analogResolution = 1024) {
+        (void) pin;
+        (void) total;
+        (void) values;
+        (void) debounceDuration;
+        (void) analogResolution;
+    }
+    void update() {
+    }
+    bool onReleaseBefore(int button, unsigned int duration) {
+        (void) button;
+        (void) duration;
+        return false;
+    }
+    bool onPressAfter(int button, unsigned int duration) {
+        (void) button;
+        (void) duration;
+        return false;
+    }
+    bool onPressAndAfter(int button, unsigned int duration,
+            unsigned int repeatTime) {
+        (void) button;
+        (void) duration;
+        (void) repeatTime;
+        return false;
+    }
+};
+
+#endif /* ANALOGMULTIBUTTON_H_ */
@@ -0,0 +1,121 @@
+#ifndef ARDUINO_H_
+#define ARDUINO_H_
+
+/************************************************************************
+ * Host stand-in for the parts of the Arduino AVR core the library uses.
+ *
+ * Time, pins, serial, EEPROM and the MCP2515 are simulated and driven
+ * through HostMock (hostmock.h). Macros the AVR core defines, like min and
+ * max, are defined the same way, so name clashes show up on the host too.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define A0 14
+#define A1 15
+#define LED_BUILTIN 13
+
+#define B00000000 0
+#define B00000010 2
+#define B00001000 8
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+#define bit(b) (1UL << (b))
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> (8)))
+
+// ATmega328P registers touched by the power code
+extern volatile uint8_t DDRB, PORTB, DDRC, PORTC, DDRD, PORTD;
+extern volatile uint8_t ADCSRA, MCUCR, SREG, PCICR, PCIFR;
+extern volatile uint8_t PCMSK0, PCMSK1, PCMSK2;
+#define BODS 6
+#define BODSE 5
+
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : NOT_AN_INTERRUPT))
+#define digitalPinToPCICR(p) (((p) >= 0 && (p) <= 21) ? (&PCICR) : ((uint8_t *) 0))
+#define digitalPinToPCICRbit(p) (((p) <= 7) ? 2 : (((p) <= 13) ? 0 : 1))
+#define digitalPinToPCMSK(p) (((p) <= 7) ? (&PCMSK2) : (((p) <= 13) ? (&PCMSK0) : (((p) <= 21) ? (&PCMSK1) : ((uint8_t *) 0))))
+#define digitalPinToPCMSKbit(p) (((p) <= 7) ? (p) : (((p) <= 13) ? ((p) - 8) : ((p) - 14)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+int analogRead(uint8_t pin);
+
+void attachInterrupt(uint8_t interrupt, void (*callback)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+void noInterrupts();
+void interrupts();
+
+class Print {
+public:
+    virtual ~Print() {
+    }
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t * buffer, size_t size);
+    size_t write(const char * text) {
+        return this->write((const uint8_t *) text, strlen(text));
+    }
+    size_t write(const char * buffer, size_t size) {
+        return this->write((const uint8_t *) buffer, size);
+    }
+    virtual int availableForWrite() {
+        return 0;
+    }
+    virtual void flush() {
+    }
+};
+
+class Stream: public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+/* Reads from HostMock::serialInput and writes to HostMock::serialOutput */
+class HardwareSerial: public Stream {
+public:
+    void begin(unsigned long baudRate);
+    void end();
+    virtual int available();
+    virtual int read();
+    virtual int peek();
+    virtual int availableForWrite();
+    virtual void flush();
+    virtual size_t write(uint8_t value);
+    virtual size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+    operator bool() {
+        return true;
+    }
+};
+
+extern HardwareSerial Serial;
+
+#endif /* ARDUINO_H_ */
@@ -0,0 +1,20 @@
+#ifndef EEPROM_H_
+#define EEPROM_H_
+
+/* Host stand-in for the EEPROM library, backed by HostMock::eeprom */
+
+#include "Arduino.h"
+
+class EEPROMClass {
+public:
+    uint8_t read(int address);
+    void write(int address, uint8_t value);
+    void update(int address, uint8_t value);
+    uint16_t length() {
+        return 1024;
+    }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif /* EEPROM_H_ */
@@ -0,0 +1,24 @@
+#ifndef SPI_H_
+#define SPI_H_
+
+/* Host stand-in for the SPI library, the MCP2515 is simulated directly */
+
+#include "Arduino.h"
+
+class SPIClass {
+public:
+    void begin() {
+    }
+    void end() {
+    }
+    void usingInterrupt(uint8_t interrupt) {
+        (void) interrupt;
+    }
+    void notUsingInterrupt(uint8_t interrupt) {
+        (void) interrupt;
+    }
+};
+
+extern SPIClass SPI;
+
+#endif /* SPI_H_ */
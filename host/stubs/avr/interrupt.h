@@ -0,0 +1,8 @@
+#ifndef AVR_INTERRUPT_H_
+#define AVR_INTERRUPT_H_
+
+/* Host stand-in for avr/interrupt.h, vectors become plain functions */
+
+#define ISR(vector) extern "C" void vector(void)
+
+#endif /* AVR_INTERRUPT_H_ */
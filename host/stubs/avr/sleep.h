@@ -0,0 +1,14 @@
+#ifndef AVR_SLEEP_H_
+#define AVR_SLEEP_H_
+
+/* Host stand-in for avr/sleep.h, sleeping only counts in HostMock */
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_PWR_DOWN 2
+
+void set_sleep_mode(int mode);
+void sleep_enable();
+void sleep_disable();
+void sleep_cpu();
+
+#endif /* AVR_SLEEP_H_ */
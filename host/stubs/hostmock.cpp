@@ -0,0 +1,322 @@
+// Standard headers first, the core's min and max macros break them
+#include "hostmock.h"
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "SPI.h"
+#include "mcp_can.h"
+#include <avr/sleep.h>
+
+// Pin change vectors, defined by the code under test if it uses them
+extern "C" void PCINT0_vect(void) __attribute__((weak));
+extern "C" void PCINT1_vect(void) __attribute__((weak));
+extern "C" void PCINT2_vect(void) __attribute__((weak));
+
+uint64_t HostMock::now = 0;
+std::deque<uint8_t> HostMock::serialInput;
+std::vector<uint8_t> HostMock::serialOutput;
+uint32_t HostMock::serialBaudRate = 0;
+int HostMock::serialTxRoom = 63;
+bool HostMock::isSerialTxConsumed = false;
+uint32_t HostMock::serialFlushCount = 0;
+uint8_t HostMock::pins[32];
+void (*HostMock::externalInterrupts[2])(void);
+std::deque<HostMock::Frame> HostMock::canReceived;
+std::vector<HostMock::Frame> HostMock::canSent;
+uint8_t HostMock::canInterruptPin = 5;
+uint8_t HostMock::canMode = MCP_NORMAL;
+uint8_t HostMock::eeprom[1024];
+uint32_t HostMock::eepromWrites = 0;
+uint32_t HostMock::sleepCount = 0;
+
+volatile uint8_t DDRB, PORTB, DDRC, PORTC, DDRD, PORTD;
+volatile uint8_t ADCSRA, MCUCR, SREG, PCICR, PCIFR;
+volatile uint8_t PCMSK0, PCMSK1, PCMSK2;
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+SPIClass SPI;
+
+void HostMock::reset() {
+    now = 0;
+    serialInput.clear();
+    serialOutput.clear();
+    serialBaudRate = 0;
+    serialTxRoom = 63;
+    isSerialTxConsumed = false;
+    serialFlushCount = 0;
+    memset(pins, HIGH, sizeof(pins));
+    externalInterrupts[0] = NULL;
+    externalInterrupts[1] = NULL;
+    PCICR = 0;
+    PCIFR = 0;
+    PCMSK0 = 0;
+    PCMSK1 = 0;
+    PCMSK2 = 0;
+    canReceived.clear();
+    canSent.clear();
+    canMode = MCP_NORMAL;
+    // Erased EEPROM
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    eepromWrites = 0;
+    sleepCount = 0;
+}
+
+void HostMock::receiveCan(uint32_t id, uint8_t length, const uint8_t data[8]) {
+    Frame frame;
+    frame.id = id;
+    frame.length = length;
+    memcpy(frame.data, data, sizeof(frame.data));
+    canReceived.push_back(frame);
+    raiseCanInterrupt();
+}
+
+void HostMock::raiseCanInterrupt() {
+    uint8_t pin = canInterruptPin;
+    int interrupt = digitalPinToInterrupt(pin);
+    if (interrupt != NOT_AN_INTERRUPT) {
+        if (externalInterrupts[interrupt]) {
+            externalInterrupts[interrupt]();
+        }
+        return;
+    }
+
+    uint8_t port = digitalPinToPCICRbit(pin);
+    if (!digitalPinToPCICR(pin) || !(PCICR & bit(port))
+            || !(*digitalPinToPCMSK(pin) & bit(digitalPinToPCMSKbit(pin)))) {
+        return;
+    }
+    void (*vectors[3])(void) = { PCINT0_vect, PCINT1_vect, PCINT2_vect };
+    if (vectors[port]) {
+        vectors[port]();
+    }
+}
+
+unsigned long millis() {
+    return (unsigned long) (uint32_t) (HostMock::now / 1000);
+}
+
+unsigned long micros() {
+    return (unsigned long) (uint32_t) HostMock::now;
+}
+
+void delay(unsigned long ms) {
+    HostMock::advanceMillis(ms);
+}
+
+void delayMicroseconds(unsigned int us) {
+    HostMock::advanceMicros(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    (void) pin;
+    (void) mode;
+}
+
+int digitalRead(uint8_t pin) {
+    if (pin == HostMock::canInterruptPin) {
+        return HostMock::canReceived.empty() ? HIGH : LOW;
+    }
+    return HostMock::pins[pin % 32];
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    HostMock::pins[pin % 32] = value;
+}
+
+int analogRead(uint8_t pin) {
+    (void) pin;
+    return 1023;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*callback)(void), int mode) {
+    (void) mode;
+    if (interrupt < 2) {
+        HostMock::externalInterrupts[interrupt] = callback;
+    }
+}
+
+void detachInterrupt(uint8_t interrupt) {
+    if (interrupt < 2) {
+        HostMock::externalInterrupts[interrupt] = NULL;
+    }
+}
+
+void noInterrupts() {
+}
+
+void interrupts() {
+}
+
+size_t Print::write(const uint8_t * buffer, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        this->write(buffer[i]);
+    }
+    return size;
+}
+
+void HardwareSerial::begin(unsigned long baudRate) {
+    HostMock::serialBaudRate = baudRate;
+}
+
+void HardwareSerial::end() {
+    this->flush();
+    HostMock::serialBaudRate = 0;
+}
+
+int HardwareSerial::available() {
+    return HostMock::serialInput.size();
+}
+
+int HardwareSerial::read() {
+    if (HostMock::serialInput.empty()) {
+        return -1;
+    }
+    int value = HostMock::serialInput.front();
+    HostMock::serialInput.pop_front();
+    return value;
+}
+
+int HardwareSerial::peek() {
+    return HostMock::serialInput.empty() ? -1 : HostMock::serialInput.front();
+}
+
+int HardwareSerial::availableForWrite() {
+    return HostMock::serialTxRoom;
+}
+
+void HardwareSerial::flush() {
+    HostMock::serialFlushCount++;
+}
+
+size_t HardwareSerial::write(uint8_t value) {
+    return this->write(&value, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t * buffer, size_t size) {
+    HostMock::serialOutput.insert(HostMock::serialOutput.end(), buffer,
+            buffer + size);
+    if (HostMock::isSerialTxConsumed) {
+        // The real write would block for whatever does not fit
+        HostMock::serialTxRoom -= size;
+    }
+    return size;
+}
+
+uint8_t EEPROMClass::read(int address) {
+    return HostMock::eeprom[address % 1024];
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+    HostMock::eeprom[address % 1024] = value;
+    HostMock::eepromWrites++;
+}
+
+void EEPROMClass::update(int address, uint8_t value) {
+    if (HostMock::eeprom[address % 1024] != value) {
+        this->write(address, value);
+    }
+}
+
+MCP_CAN::MCP_CAN(INT8U csPin) {
+    (void) csPin;
+}
+
+INT8U MCP_CAN::begin(INT8U idMode, INT8U speed, INT8U clock) {
+    (void) idMode;
+    (void) speed;
+    (void) clock;
+    HostMock::canMode = MCP_LOOPBACK;
+    return CAN_OK;
+}
+
+INT8U MCP_CAN::init_Mask(INT8U num, INT8U ext, INT32U data) {
+    (void) num;
+    (void) ext;
+    (void) data;
+    return CAN_OK;
+}
+
+INT8U MCP_CAN::init_Mask(INT8U num, INT32U data) {
+    return this->init_Mask(num, 0, data);
+}
+
+INT8U MCP_CAN::init_Filt(INT8U num, INT8U ext, INT32U data) {
+    (void) num;
+    (void) ext;
+    (void) data;
+    return CAN_OK;
+}
+
+INT8U MCP_CAN::init_Filt(INT8U num, INT32U data) {
+    return this->init_Filt(num, 0, data);
+}
+
+void MCP_CAN::setSleepWakeup(INT8U enable) {
+    (void) enable;
+}
+
+INT8U MCP_CAN::setMode(INT8U mode) {
+    HostMock::canMode = mode;
+    return CAN_OK;
+}
+
+INT8U MCP_CAN::sendMsgBuf(INT32U id, INT8U ext, INT8U length, INT8U * buffer) {
+    (void) ext;
+    HostMock::Frame frame;
+    frame.id = id;
+    frame.length = length > 8 ? 8 : length;
+    memset(frame.data, 0, sizeof(frame.data));
+    memcpy(frame.data, buffer, frame.length);
+    HostMock::canSent.push_back(frame);
+    return CAN_OK;
+}
+
+INT8U MCP_CAN::sendMsgBuf(INT32U id, INT8U length, INT8U * buffer) {
+    return this->sendMsgBuf(id, id > 0x7FF, length, buffer);
+}
+
+INT8U MCP_CAN::readMsgBuf(INT32U * id, INT8U * ext, INT8U * length,
+        INT8U * buffer) {
+    if (HostMock::canReceived.empty()) {
+        return CAN_NOMSG;
+    }
+    HostMock::Frame frame = HostMock::canReceived.front();
+    HostMock::canReceived.pop_front();
+    *id = frame.id;
+    *ext = frame.id > 0x7FF;
+    *length = frame.length;
+    memcpy(buffer, frame.data, frame.length);
+    return CAN_OK;
+}
+
+INT8U MCP_CAN::readMsgBuf(INT32U * id, INT8U * length, INT8U * buffer) {
+    INT8U ext;
+    INT8U result = this->readMsgBuf(id, &ext, length, buffer);
+    // Like the library, extended IDs carry bit 31
+    if (result == CAN_OK && ext) {
+        *id |= 0x80000000UL;
+    }
+    return result;
+}
+
+INT8U MCP_CAN::checkReceive() {
+    return HostMock::canReceived.empty() ? CAN_NOMSG : CAN_MSGAVAIL;
+}
+
+INT8U MCP_CAN::checkError() {
+    return CAN_OK;
+}
+
+void set_sleep_mode(int mode) {
+    (void) mode;
+}
+
+void sleep_enable() {
+}
+
+void sleep_disable() {
+}
+
+void sleep_cpu() {
+    HostMock::sleepCount++;
+}
@@ -0,0 +1,76 @@
+#ifndef HOSTMOCK_H_
+#define HOSTMOCK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+/************************************************************************
+ * Controls and observes the host stand-ins of the Arduino core, EEPROM
+ * and MCP_CAN.
+ *
+ * Time only moves when a test moves it, so every run is deterministic.
+ * delay() advances the clock by the requested time. The MCP2515 holds its
+ * received frames in a queue and pulls canInterruptPin low while frames
+ * are waiting, like the real controller. A received frame runs the
+ * external or pin change interrupt handler of that pin, if it is enabled.
+ */
+class HostMock {
+public:
+    struct Frame {
+        uint32_t id;
+        uint8_t length;
+        uint8_t data[8];
+    };
+
+    // Microseconds since power up
+    static uint64_t now;
+
+    static std::deque<uint8_t> serialInput;
+    static std::vector<uint8_t> serialOutput;
+    static uint32_t serialBaudRate;
+    // Free bytes reported by Serial.availableForWrite()
+    static int serialTxRoom;
+    // Writes take up serialTxRoom, which the test frees again, if set
+    static bool isSerialTxConsumed;
+    // Calls of Serial.flush(), each of them blocks on the device
+    static uint32_t serialFlushCount;
+
+    static uint8_t pins[32];
+    // Handlers of the external interrupts 0 and 1 (pins 2 and 3)
+    static void (*externalInterrupts[2])(void);
+
+    static std::deque<Frame> canReceived;
+    static std::vector<Frame> canSent;
+    static uint8_t canInterruptPin;
+    static uint8_t canMode;
+
+    static uint8_t eeprom[1024];
+    static uint32_t eepromWrites;
+
+    static uint32_t sleepCount;
+
+    /* Puts everything back to power up state */
+    static void reset();
+
+    static void setMicros(uint32_t micros) {
+        now = micros;
+    }
+    static void advanceMicros(uint32_t micros) {
+        now += micros;
+    }
+    static void advanceMillis(uint32_t millis) {
+        now += millis * 1000UL;
+    }
+
+    static void receiveSerial(const uint8_t * data, size_t length) {
+        serialInput.insert(serialInput.end(), data, data + length);
+    }
+
+    static void receiveCan(uint32_t id, uint8_t length, const uint8_t data[8]);
+    /* Runs the handler the falling canInterruptPin triggers, if any */
+    static void raiseCanInterrupt();
+};
+
+#endif /* HOSTMOCK_H_ */
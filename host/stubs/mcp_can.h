@@ -0,0 +1,62 @@
+#ifndef MCP_CAN_H_
+#define MCP_CAN_H_
+
+/************************************************************************
+ * Host stand-in for the MCP_CAN library (coryjfowler/MCP_CAN_lib).
+ *
+ * Received frames come from HostMock::canReceived, sent frames go to
+ * HostMock::canSent. Masks and filters are accepted but not applied.
+ */
+
+#include "Arduino.h"
+
+#define INT8U byte
+#define INT32U unsigned long
+
+#define MCP_ANY 0
+#define MCP_STD 1
+#define MCP_EXT 2
+#define MCP_STDEXT 3
+
+#define MCP_NORMAL 0x00
+#define MCP_SLEEP 0x20
+#define MCP_LOOPBACK 0x40
+#define MCP_LISTENONLY 0x60
+
+#define CAN_OK 0
+#define CAN_FAILINIT 1
+#define CAN_FAILTX 2
+#define CAN_MSGAVAIL 3
+#define CAN_NOMSG 4
+#define CAN_CTRLERROR 5
+#define CAN_GETTXBFTIMEOUT 6
+#define CAN_SENDMSGTIMEOUT 7
+#define CAN_FAIL 0xff
+
+#define CAN_125KBPS 12
+#define CAN_250KBPS 14
+#define CAN_500KBPS 15
+#define CAN_1000KBPS 18
+
+#define MCP_16MHZ 1
+#define MCP_8MHZ 2
+
+class MCP_CAN {
+public:
+    MCP_CAN(INT8U csPin);
+    INT8U begin(INT8U idMode, INT8U speed, INT8U clock);
+    INT8U init_Mask(INT8U num, INT8U ext, INT32U data);
+    INT8U init_Mask(INT8U num, INT32U data);
+    INT8U init_Filt(INT8U num, INT8U ext, INT32U data);
+    INT8U init_Filt(INT8U num, INT32U data);
+    void setSleepWakeup(INT8U enable);
+    INT8U setMode(INT8U mode);
+    INT8U sendMsgBuf(INT32U id, INT8U ext, INT8U length, INT8U * buffer);
+    INT8U sendMsgBuf(INT32U id, INT8U length, INT8U * buffer);
+    INT8U readMsgBuf(INT32U * id, INT8U * ext, INT8U * length, INT8U * buffer);
+    INT8U readMsgBuf(INT32U * id, INT8U * length, INT8U * buffer);
+    INT8U checkReceive();
+    INT8U checkError();
+};
+
+#endif /* MCP_CAN_H_ */
@@ -0,0 +1,55 @@
+#ifndef TEST_H_
+#define TEST_H_
+
+// Standard headers first, the core's min and max macros break them
+#include <stdio.h>
+#include <vector>
+#include "hostmock.h"
+#include "Arduino.h"
+
+/************************************************************************
+ * Checks for the host tests.
+ *
+ * A failed CHECK prints its condition and location and the test goes on,
+ * so one run shows every failure. main() returns Test::result().
+ */
+class Test {
+private:
+    static unsigned long * failures() {
+        static unsigned long count = 0;
+        return &count;
+    }
+public:
+    static bool check(bool isPassed, const char * condition,
+            const char * file, int line) {
+        if (!isPassed) {
+            printf("%s:%d: CHECK(%s) failed\n", file, line, condition);
+            (*failures())++;
+        }
+        return isPassed;
+    }
+
+    static int result() {
+        unsigned long count = *failures();
+        if (count > 0) {
+            printf("%lu checks failed\n", count);
+        }
+        return count > 0 ? 1 : 0;
+    }
+
+    /* Offset of the first frame of the type and ID in the output, or -1 */
+    static long findFrame(const std::vector<uint8_t> & output, uint8_t type,
+            uint8_t id, size_t from = 0) {
+        for (size_t i = from; i + 2 < output.size(); i++) {
+            if (output[i] == 0x7b && output[i + 1] == type
+                    && output[i + 2] == id) {
+                return (long) i;
+            }
+        }
+        return -1;
+    }
+};
+
+#define CHECK(condition) Test::check((condition), #condition, __FILE__, __LINE__)
+
+#endif /* TEST_H_ */
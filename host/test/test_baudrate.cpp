@@ -0,0 +1,58 @@
+/*
+ * CAN data waits while a new baud rate is probed, so a failed probe does
+ * not take the snapshot of a new connection with it.
+ */
+#include "test.h"
+#include "carduino.h"
+
+static void onSerialEvent(uint8_t type, uint8_t id, SerialPayload * payload) {
+}
+
+static void onTimeout() {
+}
+
+static void onCan(uint32_t canId, uint8_t data[], uint8_t length) {
+}
+
+static void run(Carduino * carduino, Can * can, uint32_t millis) {
+    for (uint32_t i = 0; i < millis; i++) {
+        HostMock::advanceMillis(1);
+        carduino->update();
+        can->updateFromCan(onCan);
+    }
+}
+
+int main() {
+    HostMock::reset();
+    HostMock::now = 1000000;
+    // 230400 baud confirmed by an earlier connection
+    const uint8_t storedRate[4] = { 0x00, 0x03, 0x84, 0x00 };
+    memcpy(&HostMock::eeprom[CARDUINO_EEPROM_BAUD_RATE], storedRate, 4);
+
+    Can can(&Serial, HostMock::canInterruptPin, 10);
+    can.setup(MCP_STD, CAN_500KBPS, MCP_8MHZ);
+    Carduino carduino(&Serial, onSerialEvent, onTimeout);
+    carduino.begin();
+    carduino.addCan(&can);
+    can.addCanPacket(0x60D, 0xFF);
+    const uint8_t data[8] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x01 };
+    HostMock::receiveCan(0x60D, 8, data);
+    run(&carduino, &can, 10);
+
+    // Connect with the stored rate, the snapshot is requested right away
+    const uint8_t connect[] = { 0x7b, 0x61, 0x00, 0x02, 0x01, 0x10, 0x7d };
+    HostMock::serialOutput.clear();
+    HostMock::receiveSerial(connect, sizeof(connect));
+    run(&carduino, &can, 100);
+    CHECK(HostMock::serialBaudRate == 230400);
+    CHECK(Test::findFrame(HostMock::serialOutput, 0x61, 0x73) >= 0);
+    CHECK(Test::findFrame(HostMock::serialOutput, 0x62, 0x05) < 0);
+
+    // The host never echoes, the rate reverts and the snapshot follows
+    run(&carduino, &can, BAUD_RATE_PROBE_TIMEOUT);
+    CHECK(HostMock::serialBaudRate == BAUD_RATE_DEFAULT);
+    long revert = Test::findFrame(HostMock::serialOutput, 0x65, 0x06);
+    CHECK(revert >= 0);
+    CHECK(Test::findFrame(HostMock::serialOutput, 0x62, 0x05, revert) > revert);
+    return Test::result();
+}
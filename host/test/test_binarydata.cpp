@@ -0,0 +1,189 @@
+/*
+ * FixedBinaryBuffer: typed fields in both byte orders, varints and the
+ * payloads SerialReader hands to its listeners, also across a restart of
+ * the serial.
+ */
+#include <deque>
+#include "test.h"
+#include "serial.h"
+
+static void testFields() {
+    FixedBinaryBuffer<32> buffer;
+    CHECK(buffer.canWrite(32));
+    CHECK(!buffer.canWrite(33));
+    buffer.writeByte(0xA5);
+    buffer.writeShort(0x1234);
+    buffer.writeShort(0x1234, FixedBinaryBuffer<32>::LSB_FIRST);
+    buffer.writeSignedShort(-2);
+    buffer.writeLong(0x89ABCDEF);
+    buffer.writeLong(0x89ABCDEF, FixedBinaryBuffer<32>::LSB_FIRST);
+    buffer.writeFloat(-1.5f);
+    CHECK(buffer.getSize() == 1 + 2 + 2 + 2 + 4 + 4 + 4);
+
+    const uint8_t expected[] = { 0xA5, 0x12, 0x34, 0x34, 0x12, 0xFF, 0xFE,
+            0x89, 0xAB, 0xCD, 0xEF, 0xEF, 0xCD, 0xAB, 0x89, 0xBF, 0xC0, 0x00,
+            0x00 };
+    CHECK(memcmp(buffer.getData(), expected, sizeof(expected)) == 0);
+
+    CHECK(buffer.canRead(19));
+    CHECK(!buffer.canRead(20));
+    CHECK(buffer.readByte() == 0xA5);
+    CHECK(buffer.readShort() == 0x1234);
+    CHECK(buffer.readShort(FixedBinaryBuffer<32>::LSB_FIRST) == 0x1234);
+    CHECK(buffer.readSignedShort() == -2);
+    CHECK(buffer.readLong() == 0x89ABCDEF);
+    CHECK(buffer.readLong(FixedBinaryBuffer<32>::LSB_FIRST) == 0x89ABCDEF);
+    CHECK(buffer.readFloat() == -1.5f);
+    CHECK(buffer.available() == 0);
+    CHECK(!buffer.canRead(1));
+}
+
+static bool readVarint(const uint8_t * data, uint8_t length, uint32_t * value,
+        uint8_t * position) {
+    FixedBinaryBuffer<8> buffer;
+    buffer.assign(data, length);
+    bool isRead = buffer.readVarint(value);
+    *position = buffer.getPosition();
+    return isRead;
+}
+
+static void testVarints() {
+    const uint32_t values[] = { 0, 1, 127, 128, 300, 0x0FFFFFFF, 0x10000000,
+            0xFFFFFFFF };
+    const uint8_t lengths[] = { 1, 1, 1, 2, 2, 4, 5, 5 };
+    for (uint8_t i = 0; i < 8; i++) {
+        FixedBinaryBuffer<8> buffer;
+        CHECK(buffer.writeVarint(values[i]));
+        CHECK(buffer.getSize() == lengths[i]);
+        uint32_t value = 0;
+        CHECK(buffer.readVarint(&value));
+        CHECK(value == values[i]);
+        CHECK(buffer.available() == 0);
+    }
+
+    // Does not fit: nothing is written
+    FixedBinaryBuffer<4> small;
+    CHECK(!small.writeVarint(0xFFFFFFFF));
+    CHECK(small.getSize() == 0);
+
+    uint32_t value = 0;
+    uint8_t position = 0;
+    const uint8_t maximum[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x0F };
+    CHECK(readVarint(maximum, sizeof(maximum), &value, &position));
+    CHECK(value == 0xFFFFFFFF && position == 5);
+    // Bits beyond 32 in the 5th byte
+    const uint8_t overflow[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x10 };
+    CHECK(!readVarint(overflow, sizeof(overflow), &value, &position));
+    CHECK(position == 0);
+    // More than 5 bytes
+    const uint8_t tooLong[] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x00 };
+    CHECK(!readVarint(tooLong, sizeof(tooLong), &value, &position));
+    CHECK(position == 0);
+    // Cut off
+    const uint8_t cutOff[] = { 0x80, 0x80 };
+    CHECK(!readVarint(cutOff, sizeof(cutOff), &value, &position));
+    CHECK(position == 0);
+}
+
+class PayloadListener: public SerialListener {
+public:
+    uint8_t count = 0;
+    uint8_t type = 0;
+    uint8_t id = 0;
+    uint32_t canId = 0;
+    uint8_t mask = 0;
+    bool isComplete = false;
+    virtual void onSerialPacket(uint8_t type, uint8_t id,
+            SerialPayload * payload) {
+        this->count++;
+        this->type = type;
+        this->id = id;
+        this->isComplete = payload->canRead(5) && payload->available() == 5;
+        if (this->isComplete) {
+            this->canId = payload->readLong();
+            this->mask = payload->readByte();
+        }
+    }
+};
+
+static void testSerialPayload() {
+    HostMock::reset();
+    SerialReader reader(&Serial);
+    PayloadListener listener;
+    const uint8_t frames[] = { 0x7b, 0x61, 0x63, 0x05, 0x00, 0x00, 0x06,
+            0x0d, 0xC0, 0x7d,
+            // Too long for the reader, dropped
+            0x7b, 0x61, 0x63, SERIAL_READER_SIZE - 1 };
+    HostMock::receiveSerial(frames, sizeof(frames));
+    reader.read(&listener);
+    CHECK(listener.count == 1);
+    CHECK(listener.type == 0x61 && listener.id == 0x63);
+    CHECK(listener.isComplete);
+    CHECK(listener.canId == 0x60D && listener.mask == 0xC0);
+    CHECK(reader.getErrorCount() == 1);
+}
+
+/* Input of the reader that counts reads with nothing received */
+class InputStream: public Stream {
+public:
+    std::deque<uint8_t> input;
+    unsigned long emptyReads = 0;
+    virtual int available() {
+        return this->input.size();
+    }
+    virtual int read() {
+        if (this->input.empty()) {
+            this->emptyReads++;
+            return -1;
+        }
+        int value = this->input.front();
+        this->input.pop_front();
+        return value;
+    }
+    virtual int peek() {
+        return this->input.empty() ? -1 : this->input.front();
+    }
+    virtual size_t write(uint8_t value) {
+        return 1;
+    }
+    using Print::write;
+};
+
+/* Restarts the serial on the first frame, which drops what was received */
+class RestartListener: public SerialListener {
+public:
+    InputStream * serial = NULL;
+    uint8_t count = 0;
+    virtual void onSerialPacket(uint8_t type, uint8_t id,
+            SerialPayload * payload) {
+        if (this->count++ == 0) {
+            this->serial->input.clear();
+        }
+    }
+};
+
+static void testSerialRestart() {
+    InputStream serial;
+    SerialReader reader(&serial);
+    RestartListener listener;
+    listener.serial = &serial;
+    const uint8_t frames[] = { 0x7b, 0x61, 0x72, 0x7d, 0x7b, 0x61, 0x73, 0x7d };
+    serial.input.insert(serial.input.end(), frames, frames + sizeof(frames));
+    reader.read(&listener);
+    CHECK(listener.count == 1);
+    CHECK(serial.emptyReads == 0);
+
+    // Bytes at the new rate are read as usual
+    serial.input.insert(serial.input.end(), frames + 4, frames + 8);
+    reader.read(&listener);
+    CHECK(listener.count == 2);
+    CHECK(reader.getErrorCount() == 0);
+}
+
+int main() {
+    testFields();
+    testVarints();
+    testSerialPayload();
+    testSerialRestart();
+    return Test::result();
+}
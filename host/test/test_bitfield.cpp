@@ -0,0 +1,128 @@
+/*
+ * BitFieldMember against a bit by bit reference, for every width from 1 to
+ * 16 bits at every offset from 0 to 15, so the single bit, byte aligned and
+ * generic access code all have to agree with it.
+ */
+#include <string.h>
+#include "test.h"
+#include "bitfield.h"
+
+#define FIELD_BYTES 4
+
+static const uint8_t patterns[][FIELD_BYTES] = {
+    { 0x00, 0x00, 0x00, 0x00 },
+    { 0xFF, 0xFF, 0xFF, 0xFF },
+    { 0xA5, 0x5A, 0x3C, 0xC3 },
+    { 0x12, 0x34, 0x56, 0x78 }
+};
+static const unsigned values[] = { 0, 1, 0x5A5A, 0xA5A5, 0xFFFF };
+
+/* Bit i of the field is bit firstBit + i counted from the MSB of byte 0 */
+static unsigned referenceRead(const uint8_t data[], int firstBit, int bitSize) {
+    unsigned value = 0;
+    for (int i = 0; i < bitSize; i++) {
+        int bit = firstBit + i;
+        value = value << 1 | ((data[bit / 8] >> (7 - bit % 8)) & 1);
+    }
+    return value;
+}
+
+static void referenceWrite(uint8_t data[], int firstBit, int bitSize,
+        unsigned value) {
+    for (int i = 0; i < bitSize; i++) {
+        int bit = firstBit + i;
+        uint8_t mask = 0x80 >> (bit % 8);
+        if (value >> (bitSize - 1 - i) & 1) {
+            data[bit / 8] |= mask;
+        } else {
+            data[bit / 8] &= ~mask;
+        }
+    }
+}
+
+template<int firstBit, int bitSize>
+struct FieldCheck {
+    union Field {
+        uint8_t data[FIELD_BYTES];
+        BitFieldMember<firstBit, bitSize> field;
+    };
+
+    static bool matches(const Field & field, const uint8_t expected[]) {
+        return memcmp(field.data, expected, FIELD_BYTES) == 0;
+    }
+
+    static void run() {
+        const unsigned mask = (1U << bitSize) - 1;
+        for (const uint8_t * pattern : patterns) {
+            Field field;
+            memcpy(field.data, pattern, FIELD_BYTES);
+            if (!CHECK(field.field == referenceRead(pattern, firstBit,
+                    bitSize))) {
+                printf("  read of %d bits at %d\n", bitSize, firstBit);
+            }
+
+            for (unsigned value : values) {
+                uint8_t expected[FIELD_BYTES];
+                unsigned old = referenceRead(pattern, firstBit, bitSize);
+
+                memcpy(field.data, pattern, FIELD_BYTES);
+                memcpy(expected, pattern, FIELD_BYTES);
+                field.field = value;
+                referenceWrite(expected, firstBit, bitSize, value & mask);
+                bool isAssigned = CHECK(matches(field, expected));
+
+                memcpy(field.data, pattern, FIELD_BYTES);
+                memcpy(expected, pattern, FIELD_BYTES);
+                field.field ^= value;
+                referenceWrite(expected, firstBit, bitSize,
+                        (old ^ value) & mask);
+                bool isToggled = CHECK(matches(field, expected));
+
+                memcpy(field.data, pattern, FIELD_BYTES);
+                memcpy(expected, pattern, FIELD_BYTES);
+                field.field |= value;
+                referenceWrite(expected, firstBit, bitSize,
+                        (old | value) & mask);
+                bool isSet = CHECK(matches(field, expected));
+
+                memcpy(field.data, pattern, FIELD_BYTES);
+                memcpy(expected, pattern, FIELD_BYTES);
+                field.field &= value;
+                referenceWrite(expected, firstBit, bitSize,
+                        (old & value) & mask);
+                bool isCleared = CHECK(matches(field, expected));
+
+                if (!isAssigned || !isToggled || !isSet || !isCleared) {
+                    printf("  %d bits at %d, value 0x%X\n", bitSize, firstBit,
+                            value);
+                }
+            }
+        }
+        FieldCheck<firstBit, bitSize - 1>::run();
+    }
+};
+
+template<int firstBit>
+struct FieldCheck<firstBit, 0> {
+    static void run() {
+    }
+};
+
+template<int firstBit>
+struct OffsetCheck {
+    static void run() {
+        FieldCheck<firstBit, 16>::run();
+        OffsetCheck<firstBit - 1>::run();
+    }
+};
+
+template<>
+struct OffsetCheck<-1> {
+    static void run() {
+    }
+};
+
+int main() {
+    OffsetCheck<15>::run();
+    return Test::result();
+}
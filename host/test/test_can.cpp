@@ -0,0 +1,106 @@
+/*
+ * What Can::updateFromCan sends to the host for the subscriptions.
+ */
+#include "test.h"
+#include "can.h"
+
+static void onCan(uint32_t canId, uint8_t data[], uint8_t length) {
+}
+
+static void run(Can * can, uint32_t millis) {
+    for (uint32_t i = 0; i < millis; i++) {
+        HostMock::advanceMillis(1);
+        can->updateFromCan(onCan);
+    }
+}
+
+/* A refresh only sends values that were received */
+static void testRefreshWithoutValue() {
+    HostMock::reset();
+    HostMock::now = 1000000;
+    SerialQueue queue(&Serial);
+    Can can(&Serial, HostMock::canInterruptPin, 10);
+    can.setSerialQueue(&queue);
+    can.setup(MCP_STD, CAN_500KBPS, MCP_8MHZ);
+    can.addCanPacket(0x456, 0xC0);
+    can.addCanPacket(0x60D, 0xFF);
+    const uint8_t data[8] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+    HostMock::receiveCan(0x60D, 8, data);
+    run(&can, 10);
+
+    HostMock::serialOutput.clear();
+    can.refresh();
+    run(&can, 10);
+    const uint8_t expected[] = { 0x7b, 0x62, 0x01, 0x0c, 0x00, 0x00, 0x06,
+            0x0d, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x7d };
+    CHECK(HostMock::serialOutput == std::vector<uint8_t>(expected,
+            expected + sizeof(expected)));
+}
+
+/* Aggregates and single frames together never write more than fits */
+static void testBulkFitsTxRoom() {
+    HostMock::reset();
+    HostMock::now = 1000000;
+    HostMock::isSerialTxConsumed = true;
+    SerialQueue queue(&Serial);
+    Can can(&Serial, HostMock::canInterruptPin, 10);
+    can.setSerialQueue(&queue);
+    can.setup(MCP_STDEXT, CAN_500KBPS, MCP_8MHZ);
+    can.setAggregating(true);
+    can.setDelta(true);
+    // Extended IDs are sent in their own frame, after the standard ones.
+    // MCP_CAN reports them with bit 31 set.
+    const uint32_t canIds[6] = { 0x100, 0x101, 0x102, 0x103, 0x104,
+            0x98DAF110 };
+    uint8_t data[8] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+    for (uint8_t i = 0; i < 6; i++) {
+        can.addCanPacket(canIds[i], 0xFF);
+    }
+    run(&can, 10);
+    for (uint8_t i = 0; i < 6; i++) {
+        data[0] = i;
+        HostMock::receiveCan(canIds[i] & 0x1FFFFFFF, 8, data);
+    }
+
+    for (uint8_t pass = 0; pass < 10; pass++) {
+        HostMock::serialTxRoom = 40;
+        run(&can, 1);
+        CHECK(HostMock::serialTxRoom >= 0);
+    }
+    // Five deltas of 11 bytes in two aggregates, one full update of 17 bytes
+    CHECK(HostMock::serialOutput.size() == 5 * 11 + 2 * 5 + 17);
+}
+
+/* Nothing received before sleeping keeps the interrupt pin low after it */
+static void testSleepDrains() {
+    HostMock::reset();
+    HostMock::now = 1000000;
+    SerialQueue queue(&Serial);
+    Can can(&Serial, HostMock::canInterruptPin, 10);
+    can.setSerialQueue(&queue);
+    can.setup(MCP_STD, CAN_500KBPS, MCP_8MHZ);
+    can.addCanPacket(0x60D, 0xFF);
+    run(&can, 10);
+    const uint8_t data[8] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+    HostMock::receiveCan(0x60D, 8, data);
+    // Arrived while the receive interrupt was masked, still in the MCP2515
+    HostMock::Frame frame = { 0x60D, 8, { 0 } };
+    HostMock::canReceived.push_back(frame);
+
+    HostMock::serialOutput.clear();
+    can.sleep();
+    CHECK(HostMock::canMode == MCP_SLEEP);
+    CHECK(digitalRead(HostMock::canInterruptPin) == HIGH);
+
+    // Neither frame is sent after waking up
+    can.setup(MCP_STD, CAN_500KBPS, MCP_8MHZ);
+    run(&can, 10);
+    CHECK(Test::findFrame(HostMock::serialOutput, 0x62, 0x01) < 0);
+}
+
+int main() {
+    testRefreshWithoutValue();
+    testBulkFitsTxRoom();
+    testSleepDrains();
+    return Test::result();
+}
@@ -0,0 +1,128 @@
+/*
+ * What CanSignalLayout extracts from frames and what CanSignalDecoder sends
+ * to the host for them.
+ */
+#include <string.h>
+#include "test.h"
+#include "can.h"
+
+static const uint8_t frame[8] = { 0xAB, 0xCD, 0x12, 0x34, 0x56, 0x78, 0x9A,
+        0xBC };
+
+static void onCan(uint32_t canId, uint8_t data[], uint8_t length) {
+}
+
+/* Value of the entry at offset of a 0x62 0x10 payload */
+static float readValue(const std::vector<uint8_t> & output, size_t offset) {
+    uint32_t bits = (uint32_t) output[offset] << 24
+            | (uint32_t) output[offset + 1] << 16
+            | (uint32_t) output[offset + 2] << 8 | output[offset + 3];
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/* Big-endian signals count their start bit from the MSB of byte 0 */
+static void testMsbFirst() {
+    CHECK((CanSignalLayout<0, 8>::extract(frame) == 0xAB));
+    CHECK((CanSignalLayout<14, 1>::extract(frame) == 0));
+    CHECK((CanSignalLayout<15, 1>::extract(frame) == 1));
+    // Across bytes 0 and 1
+    CHECK((CanSignalLayout<4, 12>::extract(frame) == 0xBCD));
+    CHECK((CanSignalLayout<6, 4>::extract(frame) == 0xF));
+    // Across bytes 1 to 3
+    CHECK((CanSignalLayout<12, 16>::extract(frame) == 0xD123));
+    CHECK((CanSignalLayout<32, 32>::extract(frame) == (int32_t) 0x56789ABC));
+    CHECK((CanSignalLayout<0, 8, CAN_MSB_FIRST, true>::extract(frame) == -85));
+    CHECK((CanSignalLayout<4, 12, CAN_MSB_FIRST, true>::extract(frame)
+            == 0xBCD - 0x1000));
+}
+
+/* Little-endian signals count their start bit from the LSB of byte 0 */
+static void testLsbFirst() {
+    CHECK((CanSignalLayout<0, 8, CAN_LSB_FIRST>::extract(frame) == 0xAB));
+    CHECK((CanSignalLayout<9, 1, CAN_LSB_FIRST>::extract(frame) == 0));
+    CHECK((CanSignalLayout<8, 1, CAN_LSB_FIRST>::extract(frame) == 1));
+    // Across bytes 0 and 1
+    CHECK((CanSignalLayout<4, 12, CAN_LSB_FIRST>::extract(frame) == 0xCDA));
+    CHECK((CanSignalLayout<6, 4, CAN_LSB_FIRST>::extract(frame) == 0x6));
+    // Across bytes 1 to 3
+    CHECK((CanSignalLayout<12, 16, CAN_LSB_FIRST>::extract(frame) == 0x412C));
+    CHECK((CanSignalLayout<32, 32, CAN_LSB_FIRST>::extract(frame)
+            == (int32_t) 0xBC9A7856));
+    CHECK((CanSignalLayout<16, 12, CAN_LSB_FIRST, true>::extract(frame)
+            == 0x412));
+    CHECK((CanSignalLayout<44, 12, CAN_LSB_FIRST, true>::extract(frame)
+            == 0x9A7 - 0x1000));
+}
+
+/* Decoded values go out once per change, scaled and offset */
+static void testDecoder() {
+    static const CanSignal signals[] = {
+        CanSignalLayout<4, 12>::signal(0x180),
+        CanSignalLayout<12, 8, CAN_LSB_FIRST, true>::signal(0x180, 0.5, -10),
+        CanSignalLayout<15, 1>::signal(0x60D)
+    };
+    HostMock::reset();
+    HostMock::now = 1000000;
+    SerialQueue queue(&Serial);
+    Can can(&Serial, HostMock::canInterruptPin, 10);
+    can.setSerialQueue(&queue);
+    can.setup(MCP_STD, CAN_500KBPS, MCP_8MHZ);
+    can.setSignals(signals, 3);
+
+    HostMock::receiveCan(0x180, 8, frame);
+    HostMock::receiveCan(0x60D, 2, frame);
+    HostMock::advanceMillis(1);
+    can.updateFromCan(onCan);
+    long offset = Test::findFrame(HostMock::serialOutput, 0x62, 0x10);
+    CHECK(offset == 0);
+    CHECK(HostMock::serialOutput.size() == 5 + 3 * 5);
+    if (offset == 0 && HostMock::serialOutput.size() == 20) {
+        CHECK(HostMock::serialOutput[3] == 15);
+        CHECK(HostMock::serialOutput[4] == 0);
+        CHECK(readValue(HostMock::serialOutput, 5) == 0xBCD);
+        // 0x2C, 44 * 0.5 - 10
+        CHECK(HostMock::serialOutput[9] == 1);
+        CHECK(readValue(HostMock::serialOutput, 10) == 12);
+        CHECK(HostMock::serialOutput[14] == 2);
+        CHECK(readValue(HostMock::serialOutput, 15) == 1);
+    }
+
+    // The same frame again changes nothing
+    HostMock::serialOutput.clear();
+    HostMock::receiveCan(0x180, 8, frame);
+    HostMock::advanceMillis(1);
+    can.updateFromCan(onCan);
+    CHECK(HostMock::serialOutput.empty());
+
+    // Only the changed signal goes out, sign extended
+    HostMock::serialOutput.clear();
+    uint8_t changed[8];
+    memcpy(changed, frame, sizeof(changed));
+    changed[2] = 0x18;
+    HostMock::receiveCan(0x180, 8, changed);
+    HostMock::advanceMillis(1);
+    can.updateFromCan(onCan);
+    CHECK(Test::findFrame(HostMock::serialOutput, 0x62, 0x10) == 0);
+    CHECK(HostMock::serialOutput.size() == 5 + 5);
+    if (HostMock::serialOutput.size() == 10) {
+        // 0x8C, -116 * 0.5 - 10
+        CHECK(HostMock::serialOutput[4] == 1);
+        CHECK(readValue(HostMock::serialOutput, 5) == -68);
+    }
+
+    // Frames too short for a signal leave it alone
+    HostMock::serialOutput.clear();
+    HostMock::receiveCan(0x180, 1, frame);
+    HostMock::advanceMillis(1);
+    can.updateFromCan(onCan);
+    CHECK(HostMock::serialOutput.empty());
+}
+
+int main() {
+    testMsbFirst();
+    testLsbFirst();
+    testDecoder();
+    return Test::result();
+}
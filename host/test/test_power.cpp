@@ -0,0 +1,116 @@
+/*
+ * How PowerManager shuts down before sleeping: the host gets its goodbye
+ * over several loop passes, none of them blocks.
+ */
+#include "test.h"
+#include "carduino.h"
+
+// Connection request for version 1 without flags, also keeps it alive
+static const uint8_t connectFrame[] = { 0x7b, 0x61, 0x00, 0x01, 0x01, 0x7d };
+
+static Carduino * carduino = NULL;
+static bool isSleepRequested = false;
+static unsigned long shutdownCalls = 0;
+
+static void onSerialEvent(uint8_t type, uint8_t id, SerialPayload * payload) {
+}
+
+static void onTimeout() {
+}
+
+static bool onSleep() {
+    return isSleepRequested;
+}
+
+static void onWakeUp() {
+}
+
+static void onLoop() {
+    carduino->update();
+}
+
+static bool onShutdown() {
+    shutdownCalls++;
+    return carduino->end();
+}
+
+/* Runs a loop pass of a millisecond, returns the time it took itself */
+static uint64_t pass(PowerManager * powerManager) {
+    HostMock::advanceMillis(1);
+    uint64_t start = HostMock::now;
+    powerManager->update<2, RISING, 500, 0>(onSleep, onWakeUp, onLoop,
+            onShutdown);
+    return HostMock::now - start;
+}
+
+static void start(PowerManager * powerManager) {
+    HostMock::reset();
+    HostMock::now = 1000000;
+    isSleepRequested = false;
+    shutdownCalls = 0;
+    powerManager->setup();
+    carduino->begin();
+}
+
+/* The shutdown frame follows the event after the delay, without blocking */
+static void testShutdownDrains() {
+    Carduino connected(&Serial, onSerialEvent, onTimeout);
+    PowerManager powerManager(&Serial, 3, 4);
+    carduino = &connected;
+    start(&powerManager);
+    HostMock::receiveSerial(connectFrame, sizeof(connectFrame));
+    for (int i = 0; i < 200; i++) {
+        pass(&powerManager);
+    }
+    CHECK(connected.isConnected());
+
+    HostMock::serialOutput.clear();
+    isSleepRequested = true;
+    uint64_t longestPass = 0;
+    uint64_t eventAt = 0;
+    uint64_t shutdownAt = 0;
+    for (int i = 0; i < 1000 && HostMock::serialBaudRate > 0; i++) {
+        uint64_t duration = pass(&powerManager);
+        if (duration > longestPass) {
+            longestPass = duration;
+        }
+        if (!eventAt && Test::findFrame(HostMock::serialOutput, 0x63, 0x02)
+                >= 0) {
+            eventAt = HostMock::now;
+        }
+        if (!shutdownAt && Test::findFrame(HostMock::serialOutput, 0x61,
+                0x03) >= 0) {
+            shutdownAt = HostMock::now;
+        }
+    }
+    CHECK(longestPass == 0);
+    CHECK(eventAt > 0 && shutdownAt > 0);
+    CHECK(shutdownAt - eventAt >= CARDUINO_SHUTDOWN_DELAY * 1000ULL);
+    CHECK(shutdownAt - eventAt < CARDUINO_SHUTDOWN_DELAY * 1000ULL + 10000);
+    CHECK(HostMock::serialBaudRate == 0);
+    CHECK(shutdownCalls > CARDUINO_SHUTDOWN_DELAY);
+    CHECK(!connected.isConnected());
+}
+
+/* Without a host, e.g. after a rejected wake up, it shuts down at once */
+static void testShutdownWithoutHost() {
+    Carduino unconnected(&Serial, onSerialEvent, onTimeout);
+    PowerManager powerManager(&Serial, 3, 4);
+    carduino = &unconnected;
+    start(&powerManager);
+    pass(&powerManager);
+
+    HostMock::serialOutput.clear();
+    isSleepRequested = true;
+    pass(&powerManager);
+    pass(&powerManager);
+    CHECK(shutdownCalls == 1);
+    CHECK(HostMock::serialBaudRate == 0);
+    CHECK(Test::findFrame(HostMock::serialOutput, 0x63, 0x02) < 0);
+}
+
+int main() {
+    testShutdownDrains();
+    testShutdownWithoutHost();
+    return Test::result();
+}
@@ -1,14 +1,23 @@
 #ifndef NETWORK_H_
 #define NETWORK_H_
 
+// Hosts may already provide these through their socket headers
+#ifndef htons
 #define htons(x) ( ((x)<< 8 & 0xFF00) | \
                    ((x)>> 8 & 0x00FF) )
+#endif
+#ifndef ntohs
 #define ntohs(x) htons(x)
+#endif
 
+#ifndef htonl
 #define htonl(x) ( ((x)<<24 & 0xFF000000UL) | \
                    ((x)<< 8 & 0x00FF0000UL) | \
                    ((x)>> 8 & 0x0000FF00UL) | \
                    ((x)>>24 & 0x000000FFUL) )
+#endif
+#ifndef ntohl
 #define ntohl(x) htonl(x)
+#endif
 
 #endif /* NETWORK_H_ */
@@ -5,6 +5,8 @@
 #include <avr/sleep.h>
 #include <SPI.h>
 #include "serialpacket.h"
+#include "statistics.h"
+#include "can.h"
 
 static volatile uint8_t interruptPinStateOnWake = 0;
 
@@ -56,66 +58,189 @@ public:
 
 static SerialPacket noSleepCallbackError(0x65, 0x40);
 
+/************************************************************************
+ * Confirms a pin state without blocking.
+ *
+ * The pin is sampled ten times over the given duration. The state is
+ * confirmed as soon as three samples match, and rejected as soon as three
+ * matches are out of reach.
+ */
+class PinConfirmation {
+public:
+    enum Result {
+        PENDING, CONFIRMED, REJECTED
+    };
+private:
+    uint8_t pin = 0;
+    uint8_t desiredState = LOW;
+    uint32_t sampleInterval = 0;
+    uint32_t lastSample = 0;
+    uint8_t samples = 0;
+    uint8_t matches = 0;
+public:
+    void start(uint8_t pin, uint8_t desiredState, uint32_t duration) {
+        this->pin = pin;
+        this->desiredState = desiredState;
+        this->sampleInterval = duration / 10;
+        this->lastSample = millis();
+        this->samples = 0;
+        this->matches = 0;
+    }
+    Result update() {
+        while (this->samples < 10 && this->matches < 3
+                && (uint32_t) (millis() - this->lastSample)
+                        >= this->sampleInterval) {
+            this->lastSample += this->sampleInterval;
+            this->samples++;
+            if (digitalRead(this->pin) == this->desiredState) {
+                this->matches++;
+            }
+        }
+        if (this->matches >= 3) {
+            return CONFIRMED;
+        }
+        if (this->matches + (10 - this->samples) < 3) {
+            return REJECTED;
+        }
+        return PENDING;
+    }
+};
+
+/************************************************************************
+ * Puts the Arduino to sleep and wakes it up again, without blocking the
+ * loop while doing so.
+ *
+ * Sleeping optionally starts with a charging phase, in which the interrupt
+ * pin is watched without powering down. After waking up, the wake callback
+ * runs right away, so CAN and serial start while the wake up is still being
+ * confirmed. Charger and peripherals are only switched on once it is. If
+ * the interrupt turns out to be too short, the shutdown callback runs and
+ * the Arduino goes back to sleep.
+ *
+ * The shutdown callback runs on every update until it returns true, so it
+ * can let the serial drain without blocking the loop.
+ *
+ * With setCanWakeUp() the MCP2515 sleeps as well and wakes both chips on
+ * bus activity. The interrupt pin is then the interrupt pin of the MCP2515
+ * with the LOW interrupt type, and the wake up is confirmed by a frame of
+ * the wake ID arriving within the interrupt duration.
+ */
 class PowerManager {
 private:
+    enum State {
+        RUNNING, SHUTTING_DOWN, FLASHING, CHARGING, WAKING
+    };
+
     Stream * serial;
     uint8_t chargerPin;
     uint8_t peripheralPin;
-    bool confirmInterrupt(uint8_t interruptPin, uint8_t desiredPinState,
-            uint32_t duration) {
-        uint32_t sampleDelay = duration / 10;
-
-        // Count samples with matching pin state
-        uint8_t counter = 0;
-        for (int i = 0; i < 10; i++) {
-            delay(sampleDelay);
-            if (digitalRead(interruptPin) == desiredPinState) {
-                counter++;
-            }
+    State state = RUNNING;
+    PinConfirmation confirmation;
+    uint8_t chargeInterrupt = LOW;
+    uint32_t chargeStart = 0;
+    uint32_t chargeDuration = 0;
+    uint8_t flashStep = 0;
+    uint32_t flashStepStart = 0;
+    Can * wakeCan = NULL;
+    uint32_t wakeId = 0;
+    uint32_t wakeStart = 0;
+
+    /* Flashes the LED three times, returns true once done */
+    bool flashLed() {
+        // LED off for 100 ms, then on for 50 ms
+        uint32_t stepDuration = this->flashStep & 1 ? 100 : 50;
+        if (this->flashStep > 0
+                && (uint32_t) (millis() - this->flashStepStart) < stepDuration) {
+            return false;
+        }
+        if (this->flashStep == 6) {
+            return true;
         }
+        this->flashStep++;
+        this->flashStepStart = millis();
+        digitalWrite(13, this->flashStep & 1 ? LOW : HIGH);
+        return false;
+    }
 
-        // Confirm interrupt if at least 3 samples match the desired pin state
-        return counter >= 3;
+    static uint8_t getWakeState(uint8_t interruptType) {
+        if (interruptType == RISING) {
+            return HIGH;
+        } else if (interruptType == CHANGE) {
+            return interruptPinStateOnWake;
+        }
+        return LOW;
     }
-    template<uint8_t INTERRUPT_PIN>
-    void sleep(void (*wakeCallback)(void), uint8_t interruptType,
-            uint32_t interruptDuration, uint32_t chargeDuration) {
 
-        // flash LED
-        pinMode(13, OUTPUT);
-        for (int i = 0; i < 3; i++) {
-            digitalWrite(13, LOW);
-            delay(100);
-            digitalWrite(13, HIGH);
-            delay(50);
+    /* Starts confirming a wake up, by pin state or by the CAN wake ID */
+    void startConfirmation(uint8_t pin, uint8_t state, uint32_t duration) {
+        if (this->wakeCan) {
+            this->wakeCan->expectWakeId(this->wakeId);
+            this->wakeStart = millis();
+        } else {
+            this->confirmation.start(pin, state, duration);
         }
+    }
 
-        // get interrupt handle
-        uint8_t interrupt = digitalPinToInterrupt(INTERRUPT_PIN);
+    PinConfirmation::Result confirmWakeUp(uint32_t duration) {
+        if (!this->wakeCan) {
+            return this->confirmation.update();
+        }
+        if (this->wakeCan->hasSeenWakeId()) {
+            return PinConfirmation::CONFIRMED;
+        }
+        if ((uint32_t) (millis() - this->wakeStart) >= duration) {
+            this->wakeCan->stopExpectingWakeId();
+            return PinConfirmation::REJECTED;
+        }
+        return PinConfirmation::PENDING;
+    }
 
+    /* Sleeping continues once the shutdown callback is done */
+    void sleep(uint32_t chargeDuration) {
+        this->chargeDuration = chargeDuration;
+        this->state = SHUTTING_DOWN;
+    }
+
+    void finishShutdown() {
+        if (this->wakeCan) {
+            this->wakeCan->sleep();
+        }
+        // Turn off SPI
+        SPI.end();
+
+        // flash LED, sleeping continues once it is done
+        pinMode(13, OUTPUT);
+        this->flashStep = 0;
+        this->state = FLASHING;
+    }
+
+    template<uint8_t INTERRUPT_PIN>
+    void startSleeping(void (*wakeCallback)(void), uint8_t interruptType,
+            uint32_t interruptDuration) {
         // disable built in power modules
         this->togglePeripherals(false);
 
         // If specified by user charge tablet for a while
-        if (chargeDuration > 0) {
+        if (this->chargeDuration > 0) {
             // Make sure charger is on!
             this->toggleCharger(true);
 
-            uint8_t chargeInterrupt = digitalRead(INTERRUPT_PIN);
-            uint32_t chargeTime = millis();
-            while (chargeDuration >= millis() - chargeTime) {
-                // wait for charge time to end or cancel sleep on interrupt
-                if (this->confirmInterrupt(INTERRUPT_PIN, !chargeInterrupt,
-                        interruptDuration)) {
-                    this->setup();
-                    if (wakeCallback) {
-                        wakeCallback();
-                    }
-                    return;
-                }
-            }
+            // Wait for charge time to end or cancel sleep on interrupt
+            this->chargeInterrupt = digitalRead(INTERRUPT_PIN);
+            this->chargeStart = millis();
+            this->confirmation.start(INTERRUPT_PIN, !this->chargeInterrupt,
+                    interruptDuration);
+            this->state = CHARGING;
+            return;
         }
 
+        this->powerDown<INTERRUPT_PIN>(wakeCallback, interruptType,
+                interruptDuration);
+    }
+
+    template<uint8_t INTERRUPT_PIN>
+    void powerDown(void (*wakeCallback)(void), uint8_t interruptType,
+            uint32_t interruptDuration) {
         // disable charger
         this->toggleCharger(false);
 
@@ -123,6 +248,9 @@ private:
         PinState powerState;
         powerState.turnOff();
 
+        // get interrupt handle
+        uint8_t interrupt = digitalPinToInterrupt(INTERRUPT_PIN);
+
         // Prepare sleep mode
         set_sleep_mode(SLEEP_MODE_PWR_DOWN);
         sleep_enable();
@@ -144,32 +272,16 @@ private:
         interrupts();
         sleep_cpu();
 
-        // Continue after waking up
-
-        uint8_t desiredPinState = LOW;
-        if (interruptType == RISING) {
-            desiredPinState = HIGH;
-        } else if (interruptType == CHANGE) {
-            desiredPinState = interruptPinStateOnWake;
-        }
-
-        // Resume if interrupt can be confirmed (signal is longer than specified duration)
-        if (this->confirmInterrupt(INTERRUPT_PIN, desiredPinState,
-                interruptDuration)) {
-            // Restore pin states and ADC before waking up
-            powerState.restore();
-
-            this->setup();
-
-            // Sanity delay
-            delay(500);
+        // Continue after waking up, the wake up is confirmed in the loop
+        startupTimes.start();
+        // Charger and peripherals stay off until then
+        powerState.restore();
+        this->startConfirmation(INTERRUPT_PIN, getWakeState(interruptType),
+                interruptDuration);
+        this->state = WAKING;
 
-            if (wakeCallback) {
-                wakeCallback();
-            }
-        } else {
-            this->sleep<INTERRUPT_PIN>(wakeCallback, interruptType,
-                    interruptDuration, 0);
+        if (wakeCallback) {
+            wakeCallback();
         }
     }
 public:
@@ -191,10 +303,114 @@ public:
     void togglePeripherals(bool state) {
         digitalWrite(this->peripheralPin, state);
     }
+    bool isWaking() {
+        return this->state == WAKING;
+    }
+    /*
+     * Halts the CPU until the next interrupt: a CAN frame, a serial byte or
+     * the timer tick, which comes at least every 1.024 ms. The callback
+     * runs with interrupts disabled and returns false if there is work
+     * left, then the CPU keeps running. Returns true if it was halted.
+     */
+    bool idle(bool (*isIdleCallback)(void)) {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        noInterrupts();
+        if (!isIdleCallback()) {
+            interrupts();
+            return false;
+        }
+        uint32_t idleStart = micros();
+        sleep_enable();
+        // No interrupt can come between enabling interrupts and sleeping
+        interrupts();
+        sleep_cpu();
+        sleep_disable();
+        statistics.add(Statistics::IDLE_TIME, micros() - idleStart);
+        return true;
+    }
+    /*
+     * Sleeps the MCP2515 of the Can along with the Arduino and confirms
+     * wake ups by a frame of the wake ID, e.g. 0x60D.
+     */
+    void setCanWakeUp(Can * can, uint32_t wakeId) {
+        this->wakeCan = can;
+        this->wakeId = wakeId;
+    }
+    /*
+     * Runs the loop callback while awake and moves between the power
+     * states. The shutdown callback runs whenever the Arduino is about to
+     * sleep, it should stop CAN and serial and return true once they are.
+     * Until then it runs again on the next update, instead of the loop.
+     */
     template<uint8_t INTERRUPT_PIN, uint8_t INTERRUPT_TYPE,
             uint32_t INTERRUPT_DURATION, uint32_t CHARGE_DURATION>
     void update(bool (*sleepCallback)(void), void (*wakeCallback)(void),
-            void (*loopCallback)(void)) {
+            void (*loopCallback)(void),
+            bool (*shutdownCallback)(void) = NULL) {
+        switch (this->state) {
+        case SHUTTING_DOWN:
+            if (!shutdownCallback || shutdownCallback()) {
+                this->finishShutdown();
+            }
+            return;
+        case FLASHING:
+            if (this->flashLed()) {
+                this->startSleeping<INTERRUPT_PIN>(wakeCallback,
+                        INTERRUPT_TYPE, INTERRUPT_DURATION);
+            }
+            return;
+        case CHARGING:
+            switch (this->confirmation.update()) {
+            case PinConfirmation::CONFIRMED:
+                // Sleep was cancelled before powering down
+                startupTimes.start();
+                if (this->wakeCan) {
+                    // Bus activity still has to carry the wake ID
+                    this->startConfirmation(INTERRUPT_PIN, LOW,
+                            INTERRUPT_DURATION);
+                    this->state = WAKING;
+                } else {
+                    startupTimes.mark(StartupTimes::WAKE_CONFIRMED);
+                    this->setup();
+                    this->state = RUNNING;
+                }
+                if (wakeCallback) {
+                    wakeCallback();
+                }
+                break;
+            case PinConfirmation::REJECTED:
+                if ((uint32_t) (millis() - this->chargeStart)
+                        > CHARGE_DURATION) {
+                    this->powerDown<INTERRUPT_PIN>(wakeCallback,
+                            INTERRUPT_TYPE, INTERRUPT_DURATION);
+                } else {
+                    this->confirmation.start(INTERRUPT_PIN,
+                            !this->chargeInterrupt, INTERRUPT_DURATION);
+                }
+                break;
+            case PinConfirmation::PENDING:
+                break;
+            }
+            return;
+        case WAKING:
+            switch (this->confirmWakeUp(INTERRUPT_DURATION)) {
+            case PinConfirmation::CONFIRMED:
+                startupTimes.mark(StartupTimes::WAKE_CONFIRMED);
+                this->setup();
+                this->state = RUNNING;
+                break;
+            case PinConfirmation::REJECTED:
+                // Interrupt was too short, go back to sleep right away
+                this->sleep(0);
+                return;
+            case PinConfirmation::PENDING:
+                break;
+            }
+            break;
+        case RUNNING:
+            break;
+        }
+
         loopCallback();
 
         if (!sleepCallback) {
@@ -202,12 +418,8 @@ public:
             return;
         }
 
-        if (sleepCallback()) {
-            // Turn off SPI
-            SPI.end();
-
-            this->sleep<INTERRUPT_PIN>(wakeCallback, INTERRUPT_TYPE,
-                    INTERRUPT_DURATION, CHARGE_DURATION);
+        if (this->state == RUNNING && sleepCallback()) {
+            this->sleep(CHARGE_DURATION);
         }
     }
 };
@@ -0,0 +1,130 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include "Arduino.h"
+#include "statistics.h"
+
+#ifndef SCHEDULER_SIZE
+#define SCHEDULER_SIZE 4
+#endif
+
+/************************************************************************
+ * Cooperative scheduler for periodic and delayed tasks.
+ *
+ * Call update() once per loop, after servicing CAN and serial. It runs at
+ * most one task per call, the one furthest past its deadline, so CAN and
+ * serial are serviced between any two tasks. Tasks must not block.
+ *
+ * The time between two calls of update() is the loop latency, its worst
+ * case is counted in Statistics::LOOP_LATENCY_MAX (us).
+ */
+class Scheduler {
+private:
+    struct Task {
+        void (*callback)(void);
+        uint32_t deadline;
+        uint32_t period;
+    };
+
+    Task tasks[SCHEDULER_SIZE];
+    uint32_t lastUpdate = 0;
+    bool isLatencyValid = false;
+
+    int8_t add(void (*callback)(void), uint32_t delay, uint32_t period) {
+        for (uint8_t i = 0; i < SCHEDULER_SIZE; i++) {
+            if (!this->tasks[i].callback) {
+                this->tasks[i].callback = callback;
+                this->tasks[i].deadline = millis() + delay;
+                this->tasks[i].period = period;
+                return i;
+            }
+        }
+        return -1;
+    }
+public:
+    Scheduler() {
+        for (uint8_t i = 0; i < SCHEDULER_SIZE; i++) {
+            this->tasks[i].callback = NULL;
+        }
+    }
+
+    /* Runs the callback every period ms, returns its ID or -1 if full */
+    int8_t every(uint32_t period, void (*callback)(void), uint32_t delay = 0) {
+        return this->add(callback, delay, period);
+    }
+
+    /* Runs the callback once after delay ms, returns its ID or -1 if full */
+    int8_t after(uint32_t delay, void (*callback)(void)) {
+        return this->add(callback, delay, 0);
+    }
+
+    void cancel(int8_t id) {
+        if (id >= 0 && id < SCHEDULER_SIZE) {
+            this->tasks[id].callback = NULL;
+        }
+    }
+
+    /* Runs the most overdue task, returns false if none was due */
+    bool update() {
+        uint32_t now = micros();
+        if (this->isLatencyValid) {
+            statistics.raise(Statistics::LOOP_LATENCY_MAX, now - this->lastUpdate);
+        }
+        this->lastUpdate = now;
+        this->isLatencyValid = true;
+
+        uint32_t time = millis();
+        int8_t due = -1;
+        uint32_t dueSince = 0;
+        for (uint8_t i = 0; i < SCHEDULER_SIZE; i++) {
+            Task * task = &this->tasks[i];
+            int32_t overdue = time - task->deadline;
+            if (task->callback && overdue >= 0
+                    && (due < 0 || (uint32_t) overdue > dueSince)) {
+                due = i;
+                dueSince = overdue;
+            }
+        }
+        if (due < 0) {
+            return false;
+        }
+
+        Task * task = &this->tasks[due];
+        void (*callback)(void) = task->callback;
+        if (task->period > 0) {
+            // Tasks that fell behind skip the missed runs instead of catching up
+            task->deadline += task->period;
+            if ((int32_t) (time - task->deadline) >= 0) {
+                task->deadline = time + task->period;
+            }
+        } else {
+            task->callback = NULL;
+        }
+        callback();
+        return true;
+    }
+
+    /* True if no task is due */
+    bool isIdle() {
+        uint32_t time = millis();
+        for (uint8_t i = 0; i < SCHEDULER_SIZE; i++) {
+            if (this->tasks[i].callback
+                    && (int32_t) (time - this->tasks[i].deadline) >= 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* Call after the loop was knowingly stopped, e.g. by sleeping */
+    void resetLatency() {
+        this->isLatencyValid = false;
+    }
+
+    /* Call after idling, the time spent idle does not count as latency */
+    void restartLatency() {
+        this->lastUpdate = micros();
+    }
+};
+
+#endif /* SCHEDULER_H_ */
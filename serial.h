@@ -2,70 +2,167 @@
 #define SERIAL_H_
 
 #include "serialpacket.h"
+#include "statistics.h"
+
+// Longest frame from the host without framing: type, id and payload
+#ifndef SERIAL_READER_SIZE
+#define SERIAL_READER_SIZE 128
+#endif
+
+/*
+ * Received frame with the read position on the first payload byte.
+ * Listeners check the length of their fields once with canRead().
+ */
+typedef FixedBinaryBuffer<SERIAL_READER_SIZE> SerialPayload;
 
 class SerialListener {
 public:
     virtual ~SerialListener() {
     }
     virtual void onSerialPacket(uint8_t type, uint8_t id,
-            BinaryBuffer *payloadBuffer) = 0;
+            SerialPayload *payloadBuffer) = 0;
 };
 
+/************************************************************************
+ * Incremental frame parser, fed one byte at a time.
+ *
+ * A frame is "{" type id [length payload] "}". The payload is read by its
+ * length byte, so payload bytes are never mistaken for the end of a frame.
+ * A frame that does not end where its length says is dropped and counted as
+ * a parse error, and the parser waits for the next start byte. So a corrupt
+ * frame costs at most one frame length before the reader is back in sync.
+ *
+ * With escaping enabled, start, end and escape bytes never appear inside a
+ * frame, and any start byte begins a new frame right away.
+ */
 class SerialReader {
 private:
-    int packetStartIndex = -1;
-    BinaryBuffer *serialBuffer;
-    Stream * serial;
-public:
-    SerialReader(uint8_t size, Stream * serial) {
-        this->serialBuffer = new BinaryBuffer(size);
-        this->serial = serial;
-    }
-    ~SerialReader() {
-        delete this->serialBuffer;
-    }
-    void read(SerialListener * listener) {
-        int packetEndIndex = -1;
-        while (this->serial->available() && this->serialBuffer->available() > 0) {
-            uint8_t data = this->serial->read();
-            this->serialBuffer->write(data);
+    enum ParserState {
+        WAIT_START, TYPE, ID, LENGTH, PAYLOAD, END
+    };
 
-            if (this->packetStartIndex == -1 && data == 0x7b) {
-                this->packetStartIndex = this->serialBuffer->getPosition();
-                continue;
-            }
+    SerialPayload buffer;
+    Stream * serial;
 
-            if (data == 0x7d) {
-                packetEndIndex = this->serialBuffer->getPosition();
+    ParserState state = WAIT_START;
+    uint8_t payloadLength = 0;
+    bool isEscaping = false;
+    bool isEscapeNext = false;
+    uint16_t errorCount = 0;
 
-                this->serialBuffer->goTo(this->packetStartIndex);
-                uint8_t type = this->serialBuffer->readByte().data;
-                uint8_t id = this->serialBuffer->readByte().data;
+    void fail() {
+        this->countError();
+        this->state = WAIT_START;
+    }
 
-                BinaryBuffer *payloadBuffer;
-                if (this->serialBuffer->getPosition() < packetEndIndex) {
-                    uint8_t payloadLength = this->serialBuffer->readByte().data;
-                    payloadBuffer = new BinaryBuffer(payloadLength);
-                    if (payloadBuffer->available() > 0
-                            && packetEndIndex
-                                    - this->serialBuffer->getPosition() > 0) {
-                        payloadBuffer->write(this->serialBuffer);
-                        payloadBuffer->goTo(0);
-                    }
-                } else {
-                    payloadBuffer = new BinaryBuffer(0);
-                }
+    void countError() {
+        this->errorCount++;
+        statistics.add(Statistics::PARSE_ERRORS);
+    }
 
-                listener->onSerialPacket(type, id, payloadBuffer);
+    void dispatch(SerialListener * listener) {
+        const uint8_t * frame = this->buffer.getData();
+        this->buffer.goTo(2);
+        listener->onSerialPacket(frame[0], frame[1], &this->buffer);
+    }
 
-                delete payloadBuffer;
+    void parse(uint8_t data, SerialListener * listener) {
+        bool isEnd = data == SERIAL_FRAME_END;
+        if (this->isEscaping) {
+            if (data == SERIAL_FRAME_START) {
+                if (this->state != WAIT_START) {
+                    this->countError();
+                }
+                this->isEscapeNext = false;
+                this->state = TYPE;
+                return;
+            }
+            if (this->state == WAIT_START) {
+                return;
+            }
+            if (data == SERIAL_FRAME_ESCAPE) {
+                this->isEscapeNext = true;
+                return;
+            }
+            if (this->isEscapeNext) {
+                this->isEscapeNext = false;
+                data ^= SERIAL_FRAME_ESCAPE_XOR;
+                isEnd = false;
+            } else if (isEnd && this->state != LENGTH && this->state != END) {
+                this->fail();
+                return;
+            }
+        }
 
-                this->serialBuffer->goTo(0);
-                packetEndIndex = -1;
-                this->packetStartIndex = -1;
+        switch (this->state) {
+        case WAIT_START:
+            if (data == SERIAL_FRAME_START) {
+                this->state = TYPE;
+            }
+            break;
+        case TYPE:
+            this->buffer.clear();
+            this->buffer.writeByte(data);
+            this->state = ID;
+            break;
+        case ID:
+            this->buffer.writeByte(data);
+            this->state = LENGTH;
+            break;
+        case LENGTH:
+            this->payloadLength = 0;
+            if (isEnd) {
+                this->state = WAIT_START;
+                this->dispatch(listener);
+            } else if (data == 0 || !this->buffer.canWrite(data)) {
+                this->fail();
+            } else {
+                this->payloadLength = data;
+                this->state = PAYLOAD;
+            }
+            break;
+        case PAYLOAD:
+            // The length was checked against the room in the buffer
+            this->buffer.writeByte(data);
+            if (this->buffer.getSize() - 2 >= this->payloadLength) {
+                this->state = END;
+            }
+            break;
+        case END:
+            if (isEnd) {
+                this->state = WAIT_START;
+                this->dispatch(listener);
+            } else {
+                this->fail();
+                // The stray byte may already start the next frame
+                if (!this->isEscaping && data == SERIAL_FRAME_START) {
+                    this->state = TYPE;
+                }
             }
+            break;
         }
     }
+public:
+    SerialReader(Stream * serial) {
+        this->serial = serial;
+    }
+    void read(SerialListener * listener) {
+        // Only parse what is already received, so a flood can not stall the loop
+        int count = this->serial->available();
+        // A listener may restart the serial (new baud rate), which drops
+        // what was received, so the count is checked against it each time
+        while (count-- > 0 && this->serial->available() > 0) {
+            this->parse(this->serial->read(), listener);
+        }
+    }
+    void setEscaping(bool isEscaping) {
+        this->isEscaping = isEscaping;
+        this->isEscapeNext = false;
+        this->state = WAIT_START;
+    }
+    uint16_t getErrorCount() {
+        return this->errorCount;
+    }
 };
 
 #endif /* SERIAL_H_ */
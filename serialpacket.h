@@ -1,8 +1,100 @@
 #ifndef SERIALPACKET_H_
 #define SERIALPACKET_H_
 
+#include <string.h>
+#include "Arduino.h"
 #include "binarydata.h"
 
+#define SERIAL_FRAME_START 0x7b
+#define SERIAL_FRAME_END 0x7d
+/*
+ * In escaped framing, start, end and escape bytes inside a frame are sent as
+ * SERIAL_FRAME_ESCAPE followed by the byte xor SERIAL_FRAME_ESCAPE_XOR.
+ */
+#define SERIAL_FRAME_ESCAPE 0x7c
+#define SERIAL_FRAME_ESCAPE_XOR 0x20
+
+/************************************************************************
+ * Assembles a complete frame in a scratch buffer, so it can be sent with
+ * one bulk write. CAPACITY includes start, type, id, length and end byte.
+ */
+template<uint8_t CAPACITY>
+class SerialFrame {
+    static_assert(CAPACITY >= 5 && CAPACITY <= 129,
+            "SerialFrame capacity must fit a payload of up to 124 bytes");
+public:
+    SerialFrame(uint8_t type, uint8_t id) {
+        this->reset(type, id);
+    }
+    void reset(uint8_t type, uint8_t id) {
+        _buffer[0] = SERIAL_FRAME_START;
+        _buffer[1] = type;
+        _buffer[2] = id;
+        _length = 4;
+    }
+    void clear() {
+        _length = 4;
+    }
+    /* Free payload bytes */
+    uint8_t available() {
+        return CAPACITY - 1 - _length;
+    }
+    uint8_t getPayloadSize() {
+        return _length - 4;
+    }
+    const uint8_t * getPayload() {
+        return &_buffer[4];
+    }
+    bool append(uint8_t value) {
+        if (available() < 1) {
+            return false;
+        }
+        _buffer[_length++] = value;
+        return true;
+    }
+    bool append(const void * data, uint8_t length) {
+        if (available() < length) {
+            return false;
+        }
+        memcpy(&_buffer[_length], data, length);
+        _length += length;
+        return true;
+    }
+    /* Appends a value in network byte order */
+    bool appendShort(uint16_t value) {
+        if (available() < 2) {
+            return false;
+        }
+        _buffer[_length++] = value >> 8;
+        _buffer[_length++] = value;
+        return true;
+    }
+    /* Appends a value in network byte order */
+    bool appendLong(uint32_t value) {
+        if (available() < 4) {
+            return false;
+        }
+        _buffer[_length++] = value >> 24;
+        _buffer[_length++] = value >> 16;
+        _buffer[_length++] = value >> 8;
+        _buffer[_length++] = value;
+        return true;
+    }
+    size_t send(Stream * serial) {
+        if (_length == 4) {
+            // No payload, so no length byte either
+            _buffer[3] = SERIAL_FRAME_END;
+            return serial->write(_buffer, 4);
+        }
+        _buffer[3] = _length - 4;
+        _buffer[_length] = SERIAL_FRAME_END;
+        return serial->write(_buffer, _length + 1);
+    }
+private:
+    uint8_t _buffer[CAPACITY];
+    uint8_t _length;
+};
+
 template<typename T>
 class SerialDataPacket {
 public:
@@ -15,14 +107,9 @@ public:
     void serialize(Stream * serial, uint32_t rateLimit = 0) {
         if (rateLimit < 1 || _lastSerializationTime == 0
                 || rateLimit <= millis() - _lastSerializationTime) {
-            serial->write("{");
-            serial->write(_type);
-            serial->write(_id);
-            if (sizeof(_payload) > 0) {
-                serial->write(sizeof(_payload));
-                serial->write((byte*) &_payload, sizeof(_payload));
-            }
-            serial->write("}");
+            SerialFrame<sizeof(_payload) + 5> frame(_type, _id);
+            frame.append(&_payload, sizeof(_payload));
+            frame.send(serial);
             _lastSerializationTime = millis();
         }
     }
@@ -0,0 +1,225 @@
+#ifndef SERIALQUEUE_H_
+#define SERIALQUEUE_H_
+
+#include "Arduino.h"
+#include "statistics.h"
+
+// Bytes per priority, the largest control frame needs one more
+#ifndef SERIAL_QUEUE_SIZE
+#define SERIAL_QUEUE_SIZE 48
+#endif
+
+class SerialQueue;
+
+/************************************************************************
+ * Stream handed to packet producers. Everything written in one call is
+ * queued as one frame with the priority of the stream.
+ */
+class QueuedStream: public Stream {
+private:
+    SerialQueue * queue;
+    uint8_t priority;
+public:
+    QueuedStream(SerialQueue * queue, uint8_t priority) {
+        this->queue = queue;
+        this->priority = priority;
+    }
+    virtual size_t write(uint8_t value) {
+        return this->write(&value, 1);
+    }
+    virtual size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+    virtual int available() {
+        return 0;
+    }
+    virtual int read() {
+        return -1;
+    }
+    virtual int peek() {
+        return -1;
+    }
+    virtual void flush();
+};
+
+/************************************************************************
+ * Non-blocking outbound queue in front of the hardware serial.
+ *
+ * Control frames (replies and errors) always go out before user events.
+ * Frames are never interleaved, a frame that is being sent is finished
+ * before the next one starts. Queued bytes are only handed to the serial
+ * as far as its transmit buffer has room, so update() never blocks.
+ * Neither does writing: a frame that does not fit the queue of its
+ * priority is dropped and counted, the host asks again if it misses a
+ * reply.
+ *
+ * Bulk data (CAN updates) is not queued at all. Producers check canSend()
+ * and keep their latest value until the link is free, so stale values are
+ * replaced instead of piling up, then write to the BULK stream, which goes
+ * straight to the serial.
+ */
+class SerialQueue {
+public:
+    enum Priority {
+        CONTROL = 0, EVENT = 1, PRIORITY_COUNT = 2,
+        // Not queued, written right away
+        BULK = PRIORITY_COUNT
+    };
+private:
+    struct Ring {
+        uint8_t data[SERIAL_QUEUE_SIZE];
+        uint8_t head = 0;
+        uint8_t tail = 0;
+        uint8_t used = 0;
+    };
+
+    HardwareSerial * serial;
+    Ring rings[PRIORITY_COUNT];
+    QueuedStream * streams[PRIORITY_COUNT + 1];
+    int8_t activePriority = -1;
+    uint8_t activeRemaining = 0;
+    uint16_t droppedCount = 0;
+    bool isBulkHeld = false;
+
+    size_t getFree(Ring * ring) {
+        return SERIAL_QUEUE_SIZE - ring->used;
+    }
+
+    void push(Ring * ring, uint8_t value) {
+        ring->data[ring->head] = value;
+        ring->head = (ring->head + 1) % SERIAL_QUEUE_SIZE;
+        ring->used++;
+    }
+
+    uint8_t pop(Ring * ring) {
+        uint8_t value = ring->data[ring->tail];
+        ring->tail = (ring->tail + 1) % SERIAL_QUEUE_SIZE;
+        ring->used--;
+        return value;
+    }
+public:
+    SerialQueue(HardwareSerial * serial) {
+        this->serial = serial;
+        for (uint8_t i = 0; i <= PRIORITY_COUNT; i++) {
+            this->streams[i] = new QueuedStream(this, i);
+        }
+    }
+    ~SerialQueue() {
+        for (uint8_t i = 0; i <= PRIORITY_COUNT; i++) {
+            delete this->streams[i];
+        }
+    }
+
+    Stream * getStream(Priority priority) {
+        return this->streams[priority];
+    }
+
+    size_t enqueue(uint8_t priority, const uint8_t * buffer, size_t size) {
+        // Producers of bulk data checked canSend(), so the queue is empty
+        // and the serial has room
+        if (priority == BULK) {
+            statistics.add(Statistics::BYTES_SENT, size);
+            return this->serial->write(buffer, size);
+        }
+
+        // Make room first, the frame is queued behind one length byte
+        this->update();
+        Ring * ring = &this->rings[priority];
+        if (size >= SERIAL_QUEUE_SIZE || this->getFree(ring) < size + 1) {
+            this->droppedCount++;
+            statistics.add(Statistics::TX_DROPPED);
+            return 0;
+        }
+
+        this->push(ring, size);
+        for (size_t i = 0; i < size; i++) {
+            this->push(ring, buffer[i]);
+        }
+        this->update();
+        return size;
+    }
+
+    /* Hands queued bytes to the serial as far as it has room */
+    void update() {
+        int space = this->serial->availableForWrite();
+        while (space > 0) {
+            if (this->activeRemaining == 0) {
+                this->activePriority = -1;
+                for (uint8_t i = 0; i < PRIORITY_COUNT; i++) {
+                    if (this->rings[i].used > 0) {
+                        this->activePriority = i;
+                        this->activeRemaining = this->pop(&this->rings[i]);
+                        break;
+                    }
+                }
+                if (this->activePriority < 0) {
+                    return;
+                }
+            }
+
+            Ring * ring = &this->rings[this->activePriority];
+            uint8_t count = 0;
+            while (space > 0 && this->activeRemaining > 0) {
+                this->serial->write(this->pop(ring));
+                this->activeRemaining--;
+                space--;
+                count++;
+            }
+            statistics.add(Statistics::BYTES_SENT, count);
+        }
+    }
+
+    bool isIdle() {
+        return this->activeRemaining == 0
+                && this->rings[CONTROL].used == 0
+                && this->rings[EVENT].used == 0;
+    }
+
+    /* True if bulk data of the given length can be written without blocking */
+    bool canSend(uint8_t length) {
+        this->update();
+        return !this->isBulkHeld && this->isIdle()
+                && this->serial->availableForWrite() >= length;
+    }
+
+    /*
+     * Keeps canSend() false while held, e.g. while the link runs at a rate
+     * the host has not confirmed yet. Producers keep their data meanwhile.
+     */
+    void holdBulk(bool isHeld) {
+        this->isBulkHeld = isHeld;
+    }
+
+    /* Blocks until everything queued has been sent */
+    void flush() {
+        while (!this->isIdle()) {
+            this->update();
+        }
+        this->serial->flush();
+    }
+
+    /* Drops everything queued, e.g. when the connection is closed */
+    void clear() {
+        for (uint8_t i = 0; i < PRIORITY_COUNT; i++) {
+            this->rings[i].head = 0;
+            this->rings[i].tail = 0;
+            this->rings[i].used = 0;
+        }
+        this->activePriority = -1;
+        this->activeRemaining = 0;
+    }
+
+    /* Number of frames dropped for a full queue */
+    uint16_t getDroppedCount() {
+        return this->droppedCount;
+    }
+};
+
+inline size_t QueuedStream::write(const uint8_t * buffer, size_t size) {
+    return this->queue->enqueue(this->priority, buffer, size);
+}
+
+inline void QueuedStream::flush() {
+    this->queue->flush();
+}
+
+#endif /* SERIALQUEUE_H_ */
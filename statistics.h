@@ -0,0 +1,104 @@
+#ifndef STATISTICS_H_
+#define STATISTICS_H_
+
+#include "Arduino.h"
+
+/************************************************************************
+ * Runtime counters of the firmware, sent to the host on request.
+ *
+ * Counting is a single increment on the hot paths. Everything is counted
+ * from the main loop, frames taken by the CAN interrupt when they leave the
+ * receive buffer, so a snapshot and its reset never lose a count.
+ */
+class Statistics {
+public:
+    enum Counter {
+        FRAMES_RECEIVED = 0,  // CAN frames taken from the controller
+        FRAMES_MATCHED,       // CAN frames belonging to a subscription
+        FRAMES_DROPPED,       // CAN frames lost to a full buffer or busy serial
+        BYTES_SENT,           // Bytes handed to the serial
+        TX_DROPPED,           // Control and event frames the queue had no room for
+        PARSE_ERRORS,         // Malformed frames received from the host
+        CAN_SEND_BUFFER_FULL, // CAN frames not sent for lack of a TX buffer
+        LOOP_LATENCY_MAX,     // Longest time between two loop passes (us)
+        IDLE_TIME,            // Time spent idle, waiting for interrupts (us)
+        COUNTER_COUNT
+    };
+private:
+    uint32_t counters[COUNTER_COUNT];
+public:
+    Statistics() {
+        for (uint8_t i = 0; i < COUNTER_COUNT; i++) {
+            this->counters[i] = 0;
+        }
+    }
+    inline void add(Counter counter, uint32_t count = 1) {
+        this->counters[counter] += count;
+    }
+    /* For counters that keep the highest value seen, max() is a macro on AVR */
+    inline void raise(Counter counter, uint32_t value) {
+        if (value > this->counters[counter]) {
+            this->counters[counter] = value;
+        }
+    }
+    /* Copies all counters, and optionally resets them in the same step */
+    void snapshot(uint32_t values[COUNTER_COUNT], bool isReset) {
+        for (uint8_t i = 0; i < COUNTER_COUNT; i++) {
+            values[i] = this->counters[i];
+            if (isReset) {
+                this->counters[i] = 0;
+            }
+        }
+    }
+};
+
+static Statistics statistics;
+
+/************************************************************************
+ * Time each startup phase took, in ms since power up or wake up.
+ *
+ * Only the first time a phase is reached counts, phases not reached yet
+ * read 0xFFFF.
+ */
+class StartupTimes {
+public:
+    enum Phase {
+        WAKE_CONFIRMED = 0, // Wake up interrupt confirmed as long enough
+        CAN_STARTED,        // CAN controller initialised
+        FIRST_FRAME,        // First CAN frame processed
+        CONNECTED,          // Host connected
+        PHASE_COUNT
+    };
+private:
+    uint32_t startedAt = 0;
+    uint16_t phases[PHASE_COUNT];
+public:
+    StartupTimes() {
+        for (uint8_t i = 0; i < PHASE_COUNT; i++) {
+            this->phases[i] = 0xFFFF;
+        }
+    }
+    void start() {
+        this->startedAt = millis();
+        for (uint8_t i = 0; i < PHASE_COUNT; i++) {
+            this->phases[i] = 0xFFFF;
+        }
+    }
+    inline bool isReached(Phase phase) {
+        return this->phases[phase] != 0xFFFF;
+    }
+    void mark(Phase phase) {
+        if (this->isReached(phase)) {
+            return;
+        }
+        uint32_t elapsed = millis() - this->startedAt;
+        this->phases[phase] = elapsed < 0xFFFE ? elapsed : 0xFFFE;
+    }
+    uint16_t get(Phase phase) {
+        return this->phases[phase];
+    }
+};
+
+static StartupTimes startupTimes;
+
+#endif /* STATISTICS_H_ */